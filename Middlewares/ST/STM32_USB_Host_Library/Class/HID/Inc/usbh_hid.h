@@ -52,11 +52,14 @@ extern "C" {
   * @{
   */
 
+#ifndef HID_MIN_POLL
 #define HID_MIN_POLL                                10U
+#endif
 #define HID_REPORT_SIZE                             16U
 #define HID_MAX_USAGE                               10U
 #define HID_MAX_NBR_REPORT_FMT                      10U
 #define HID_QUEUE_SIZE                              10U
+#define HID_AUX_REPORT_SIZE                         64U
 
 #define  HID_ITEM_LONG                              0xFEU
 
@@ -122,6 +125,7 @@ typedef enum
   HID_REQ_SET_IDLE,
   HID_REQ_SET_PROTOCOL,
   HID_REQ_SET_REPORT,
+  HID_REQ_GET_AUX_REPORT_DESC,
 
 }
 HID_CtlStateTypeDef;
@@ -216,14 +220,34 @@ typedef struct _HID_Process
   uint8_t              InEp;
   HID_CtlStateTypeDef  ctl_state;
   FIFO_TypeDef         fifo;
-  uint8_t              *pData;
+  uint8_t              *pData;      /* The report being passed to USBH_HID_EventCallback */
   uint16_t             length;
   uint8_t              ep_addr;
   uint16_t             poll;
   uint32_t             timer;
-  uint8_t              DataReady;
+  uint16_t             DataLength;  /* Received length of the report in pData */
+  uint32_t             DataTimer;   /* Frame in which its IN transfer completed */
+  /* IN transfers alternate between two buffers, so that the next one is started from the interrupt as
+     soon as one completes, while the report just received is being processed. Transfer n goes to
+     pRxBuffers[n % 2], and may only be started after report n-2 has been processed. */
+  uint8_t              *pRxBuffers[2];
+  __IO uint16_t        RxLength[2];
+  __IO uint32_t        RxTimer[2];
+  __IO uint8_t         RxPending;   /* A transfer has been started and hasn't completed yet */
+  __IO uint8_t         RxCount;     /* Transfers completed, written by the interrupt */
+  __IO uint8_t         DoneCount;   /* Reports processed, written by USBH_HID_Process */
   HID_DescTypeDef      HID_Desc;
+  uint8_t              protocol;
   USBH_StatusTypeDef(* Init)(USBH_HandleTypeDef *phost);
+  /* Another HID interface of the same device, e.g. with consumer control keys.
+     Its reports are passed to USBH_HID_AuxReportCallback(). */
+  uint8_t              AuxInterface;
+  uint8_t              AuxInPipe;
+  uint16_t             AuxLength;
+  uint16_t             AuxPoll;
+  uint32_t             AuxTimer;
+  uint8_t              AuxDataReady;
+  uint8_t              AuxData[HID_AUX_REPORT_SIZE];
 }
 HID_HandleTypeDef;
 
@@ -253,6 +277,10 @@ HID_HandleTypeDef;
 #define HID_KEYBRD_BOOT_CODE                          0x01U
 #define HID_MOUSE_BOOT_CODE                           0x02U
 
+/* Set_Protocol values */
+#define HID_BOOT_PROTOCOL                             0x00U
+#define HID_REPORT_PROTOCOL                           0x01U
+
 
 /**
   * @}
@@ -305,10 +333,24 @@ USBH_StatusTypeDef USBH_HID_SetProtocol(USBH_HandleTypeDef *phost,
 
 void USBH_HID_EventCallback(USBH_HandleTypeDef *phost);
 
+uint8_t USBH_HID_ReportDescriptorCallback(USBH_HandleTypeDef *phost,
+                                          const uint8_t *desc,
+                                          uint16_t length);
+
+uint8_t USBH_HID_AuxReportDescriptorCallback(USBH_HandleTypeDef *phost,
+                                             const uint8_t *desc,
+                                             uint16_t length);
+
+void USBH_HID_AuxReportCallback(USBH_HandleTypeDef *phost,
+                                const uint8_t *report,
+                                uint16_t length);
+
 HID_TypeTypeDef USBH_HID_GetDeviceType(USBH_HandleTypeDef *phost);
 
 uint8_t USBH_HID_GetPollInterval(USBH_HandleTypeDef *phost);
 
+void USBH_HID_NotifyURBDone(USBH_HandleTypeDef *phost, uint8_t pipe);
+
 void USBH_HID_FifoInit(FIFO_TypeDef *f, uint8_t *buf, uint16_t size);
 
 uint16_t  USBH_HID_FifoRead(FIFO_TypeDef *f, void *buf, uint16_t  nbytes);
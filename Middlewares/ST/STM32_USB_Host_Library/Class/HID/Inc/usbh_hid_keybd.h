@@ -50,6 +50,9 @@ extern "C" {
 /** @defgroup USBH_HID_KEYBD_Exported_Types
   * @{
   */
+/* Reports can be up to wMaxPacketSize of a full speed interrupt endpoint in report protocol */
+#define HID_KEYBD_MAX_REPORT_SIZE              64U
+
 #define KEY_NONE                               0x00
 #define KEY_ERRORROLLOVER                      0x01
 #define KEY_POSTFAIL                           0x02
@@ -103,7 +103,12 @@ static USBH_StatusTypeDef USBH_HID_InterfaceDeInit(USBH_HandleTypeDef *phost);
 static USBH_StatusTypeDef USBH_HID_ClassRequest(USBH_HandleTypeDef *phost);
 static USBH_StatusTypeDef USBH_HID_Process(USBH_HandleTypeDef *phost);
 static USBH_StatusTypeDef USBH_HID_SOFProcess(USBH_HandleTypeDef *phost);
-static void  USBH_HID_ParseHIDDesc(HID_DescTypeDef *desc, uint8_t *buf);
+static void  USBH_HID_ParseHIDDesc(HID_DescTypeDef *desc, uint8_t *buf, uint8_t interface);
+static void  USBH_HID_FindAuxInterface(USBH_HandleTypeDef *phost, uint8_t interface);
+static USBH_StatusTypeDef USBH_HID_GetAuxReportDescriptor(USBH_HandleTypeDef *phost,
+                                                          uint16_t length);
+static void  USBH_HID_AuxProcess(USBH_HandleTypeDef *phost);
+static void  USBH_HID_StartInTransfer(USBH_HandleTypeDef *phost);
 
 extern USBH_StatusTypeDef USBH_HID_MouseInit(USBH_HandleTypeDef *phost);
 extern USBH_StatusTypeDef USBH_HID_KeybdInit(USBH_HandleTypeDef *phost);
@@ -234,9 +239,69 @@ static USBH_StatusTypeDef USBH_HID_InterfaceInit(USBH_HandleTypeDef *phost)
     }
   }
 
+  USBH_HID_FindAuxInterface(phost, interface);
+
   return USBH_OK;
 }
 
+/**
+  * @brief  USBH_HID_FindAuxInterface
+  *         The function opens the IN pipe of another HID interface of the
+  *         device, if there is one.
+  * @param  phost: Host handle
+  * @param  interface: Interface used by the class
+  * @retval None
+  */
+static void USBH_HID_FindAuxInterface(USBH_HandleTypeDef *phost, uint8_t interface)
+{
+  HID_HandleTypeDef *HID_Handle = (HID_HandleTypeDef *) phost->pActiveClass->pData;
+  USBH_InterfaceDescTypeDef *itf;
+  uint8_t max_itf;
+  uint8_t max_ep;
+  uint8_t idx;
+  uint8_t num;
+
+  max_itf = ((phost->device.CfgDesc.bNumInterfaces <= USBH_MAX_NUM_INTERFACES) ?
+             phost->device.CfgDesc.bNumInterfaces : USBH_MAX_NUM_INTERFACES);
+
+  for (idx = 0U; idx < max_itf; idx++)
+  {
+    itf = &phost->device.CfgDesc.Itf_Desc[idx];
+    if ((idx == interface) || (itf->bInterfaceClass != USB_HID_CLASS) || (itf->bAlternateSetting != 0U))
+    {
+      continue;
+    }
+
+    max_ep = ((itf->bNumEndpoints <= USBH_MAX_NUM_ENDPOINTS) ? itf->bNumEndpoints : USBH_MAX_NUM_ENDPOINTS);
+    for (num = 0U; num < max_ep; num++)
+    {
+      if ((itf->Ep_Desc[num].bEndpointAddress & 0x80U) == 0U)
+      {
+        continue;
+      }
+
+      HID_Handle->AuxInterface = idx;
+      HID_Handle->AuxLength = itf->Ep_Desc[num].wMaxPacketSize;
+      if (HID_Handle->AuxLength > HID_AUX_REPORT_SIZE)
+      {
+        HID_Handle->AuxLength = HID_AUX_REPORT_SIZE;
+      }
+      HID_Handle->AuxPoll = itf->Ep_Desc[num].bInterval;
+      if (HID_Handle->AuxPoll < HID_MIN_POLL)
+      {
+        HID_Handle->AuxPoll = HID_MIN_POLL;
+      }
+      HID_Handle->AuxDataReady = 1U;
+
+      HID_Handle->AuxInPipe = USBH_AllocPipe(phost, itf->Ep_Desc[num].bEndpointAddress);
+      USBH_OpenPipe(phost, HID_Handle->AuxInPipe, itf->Ep_Desc[num].bEndpointAddress, phost->device.address,
+                    phost->device.speed, USB_EP_TYPE_INTR, HID_Handle->AuxLength);
+      USBH_LL_SetToggle(phost, HID_Handle->AuxInPipe, 0U);
+      return;
+    }
+  }
+}
+
 /**
   * @brief  USBH_HID_InterfaceDeInit
   *         The function DeInit the Pipes used for the HID class.
@@ -261,6 +326,13 @@ static USBH_StatusTypeDef USBH_HID_InterfaceDeInit(USBH_HandleTypeDef *phost)
     HID_Handle->OutPipe = 0U;     /* Reset the pipe as Free */
   }
 
+  if (HID_Handle->AuxInPipe != 0x00U)
+  {
+    USBH_ClosePipe(phost, HID_Handle->AuxInPipe);
+    USBH_FreePipe(phost, HID_Handle->AuxInPipe);
+    HID_Handle->AuxInPipe = 0U;     /* Reset the pipe as Free */
+  }
+
   if (phost->pActiveClass->pData)
   {
     USBH_free(phost->pActiveClass->pData);
@@ -283,6 +355,8 @@ static USBH_StatusTypeDef USBH_HID_ClassRequest(USBH_HandleTypeDef *phost)
   USBH_StatusTypeDef status         = USBH_BUSY;
   USBH_StatusTypeDef classReqStatus = USBH_BUSY;
   HID_HandleTypeDef *HID_Handle = (HID_HandleTypeDef *) phost->pActiveClass->pData;
+  HID_DescTypeDef auxHIDDesc;
+  uint16_t reportDescLength;
 
   /* Switch HID state machine */
   switch (HID_Handle->ctl_state)
@@ -290,19 +364,26 @@ static USBH_StatusTypeDef USBH_HID_ClassRequest(USBH_HandleTypeDef *phost)
   case HID_REQ_INIT:
   case HID_REQ_GET_HID_DESC:
 
-    USBH_HID_ParseHIDDesc(&HID_Handle->HID_Desc, phost->device.CfgDesc_Raw);
+    USBH_HID_ParseHIDDesc(&HID_Handle->HID_Desc, phost->device.CfgDesc_Raw,
+                          phost->device.CfgDesc.Itf_Desc[phost->device.current_interface].bInterfaceNumber);
 
     HID_Handle->ctl_state = HID_REQ_GET_REPORT_DESC;
 
     break;
   case HID_REQ_GET_REPORT_DESC:
 
-    /* Get Report Desc */
-    classReqStatus = USBH_HID_GetHIDReportDescriptor(phost, HID_Handle->HID_Desc.wItemLength);
+    /* Get Report Desc, no more of it than fits in phost->device.Data */
+    reportDescLength = HID_Handle->HID_Desc.wItemLength;
+    if (reportDescLength > USBH_MAX_DATA_BUFFER)
+    {
+      reportDescLength = USBH_MAX_DATA_BUFFER;
+    }
+    classReqStatus = USBH_HID_GetHIDReportDescriptor(phost, reportDescLength);
     if (classReqStatus == USBH_OK)
     {
-      /* The descriptor is available in phost->device.Data */
-      HID_Handle->ctl_state = HID_REQ_SET_IDLE;
+      /* The descriptor is available in phost->device.Data until the class is initialized */
+      HID_Handle->protocol = USBH_HID_ReportDescriptorCallback(phost, phost->device.Data, reportDescLength);
+      HID_Handle->ctl_state = (HID_Handle->AuxInPipe != 0U) ? HID_REQ_GET_AUX_REPORT_DESC : HID_REQ_SET_IDLE;
     }
     else if (classReqStatus == USBH_NOT_SUPPORTED)
     {
@@ -316,6 +397,41 @@ static USBH_StatusTypeDef USBH_HID_ClassRequest(USBH_HandleTypeDef *phost)
 
     break;
 
+  case HID_REQ_GET_AUX_REPORT_DESC:
+
+    USBH_HID_ParseHIDDesc(&auxHIDDesc, phost->device.CfgDesc_Raw,
+                          phost->device.CfgDesc.Itf_Desc[HID_Handle->AuxInterface].bInterfaceNumber);
+    reportDescLength = auxHIDDesc.wItemLength;
+    if (reportDescLength > USBH_MAX_DATA_BUFFER)
+    {
+      reportDescLength = USBH_MAX_DATA_BUFFER;
+    }
+    classReqStatus = USBH_HID_GetAuxReportDescriptor(phost, reportDescLength);
+    if (classReqStatus == USBH_OK)
+    {
+      if (USBH_HID_AuxReportDescriptorCallback(phost, phost->device.Data, reportDescLength) == 0U)
+      {
+        USBH_ClosePipe(phost, HID_Handle->AuxInPipe);
+        USBH_FreePipe(phost, HID_Handle->AuxInPipe);
+        HID_Handle->AuxInPipe = 0U;
+      }
+      HID_Handle->ctl_state = HID_REQ_SET_IDLE;
+    }
+    else if (classReqStatus == USBH_NOT_SUPPORTED)
+    {
+      /* The main interface is still usable without this one */
+      USBH_ClosePipe(phost, HID_Handle->AuxInPipe);
+      USBH_FreePipe(phost, HID_Handle->AuxInPipe);
+      HID_Handle->AuxInPipe = 0U;
+      HID_Handle->ctl_state = HID_REQ_SET_IDLE;
+    }
+    else
+    {
+      /* .. */
+    }
+
+    break;
+
   case HID_REQ_SET_IDLE:
 
     classReqStatus = USBH_HID_SetIdle(phost, 0U, 0U);
@@ -336,7 +452,7 @@ static USBH_StatusTypeDef USBH_HID_ClassRequest(USBH_HandleTypeDef *phost)
 
   case HID_REQ_SET_PROTOCOL:
     /* set protocol */
-    classReqStatus = USBH_HID_SetProtocol(phost, 0U);
+    classReqStatus = USBH_HID_SetProtocol(phost, HID_Handle->protocol);
     if (classReqStatus == USBH_OK)
     {
       HID_Handle->ctl_state = HID_REQ_IDLE;
@@ -374,7 +490,6 @@ static USBH_StatusTypeDef USBH_HID_Process(USBH_HandleTypeDef *phost)
 {
   USBH_StatusTypeDef status = USBH_OK;
   HID_HandleTypeDef *HID_Handle = (HID_HandleTypeDef *) phost->pActiveClass->pData;
-  uint32_t XferSize;
 
   switch (HID_Handle->state)
   {
@@ -442,47 +557,46 @@ static USBH_StatusTypeDef USBH_HID_Process(USBH_HandleTypeDef *phost)
       break;
 
     case HID_GET_DATA:
-      USBH_InterruptReceiveData(phost, HID_Handle->pData,
-                                (uint8_t)HID_Handle->length,
-                                HID_Handle->InPipe);
-
+      /* Nothing is in progress on the IN pipe here, so the interrupt can't start a transfer meanwhile */
+      HID_Handle->RxPending = 1U;
       HID_Handle->state = HID_POLL;
-      HID_Handle->timer = phost->Timer;
-      HID_Handle->DataReady = 0U;
+      USBH_HID_StartInTransfer(phost);
       break;
 
     case HID_POLL:
-      if (USBH_LL_GetURBState(phost, HID_Handle->InPipe) == USBH_URB_DONE)
+      USBH_HID_AuxProcess(phost);
+
+      while (HID_Handle->DoneCount != HID_Handle->RxCount)
       {
-        XferSize = USBH_LL_GetLastXferSize(phost, HID_Handle->InPipe);
+        /* The buffer isn't reused until DoneCount is incremented */
+        HID_Handle->pData = HID_Handle->pRxBuffers[HID_Handle->DoneCount & 1U];
+        HID_Handle->DataLength = HID_Handle->RxLength[HID_Handle->DoneCount & 1U];
+        HID_Handle->DataTimer = HID_Handle->RxTimer[HID_Handle->DoneCount & 1U];
 
-        if ((HID_Handle->DataReady == 0U) && (XferSize != 0U))
+        if (HID_Handle->DataLength != 0U)
         {
-          USBH_HID_FifoWrite(&HID_Handle->fifo, HID_Handle->pData, HID_Handle->length);
-          HID_Handle->DataReady = 1U;
           USBH_HID_EventCallback(phost);
+        }
+        HID_Handle->DoneCount++;
 
 #if (USBH_USE_OS == 1U)
-          phost->os_msg = (uint32_t)USBH_URB_EVENT;
+        phost->os_msg = (uint32_t)USBH_URB_EVENT;
 #if (osCMSIS < 0x20000U)
-          (void)osMessagePut(phost->os_event, phost->os_msg, 0U);
+        (void)osMessagePut(phost->os_event, phost->os_msg, 0U);
 #else
-          (void)osMessageQueuePut(phost->os_event, &phost->os_msg, 0U, NULL);
+        (void)osMessageQueuePut(phost->os_event, &phost->os_msg, 0U, NULL);
 #endif
 #endif
-        }
       }
-      else
+
+      /* IN Endpoint Stalled */
+      if (USBH_LL_GetURBState(phost, HID_Handle->InPipe) == USBH_URB_STALL)
       {
-        /* IN Endpoint Stalled */
-        if (USBH_LL_GetURBState(phost, HID_Handle->InPipe) == USBH_URB_STALL)
+        /* Issue Clear Feature on interrupt IN endpoint */
+        if (USBH_ClrFeature(phost, HID_Handle->ep_addr) == USBH_OK)
         {
-          /* Issue Clear Feature on interrupt IN endpoint */
-          if (USBH_ClrFeature(phost, HID_Handle->ep_addr) == USBH_OK)
-          {
-            /* Change state to issue next IN token */
-            HID_Handle->state = HID_GET_DATA;
-          }
+          /* Change state to issue next IN token */
+          HID_Handle->state = HID_GET_DATA;
         }
       }
       break;
@@ -508,21 +622,126 @@ static USBH_StatusTypeDef USBH_HID_SOFProcess(USBH_HandleTypeDef *phost)
   {
     if ((phost->Timer - HID_Handle->timer) >= HID_Handle->poll)
     {
-      HID_Handle->state = HID_GET_DATA;
-
-#if (USBH_USE_OS == 1U)
-      phost->os_msg = (uint32_t)USBH_URB_EVENT;
-#if (osCMSIS < 0x20000U)
-      (void)osMessagePut(phost->os_event, phost->os_msg, 0U);
-#else
-      (void)osMessageQueuePut(phost->os_event, &phost->os_msg, 0U, NULL);
-#endif
-#endif
+      /* Normally the transfer is restarted as soon as the previous one completes, see USBH_HID_NotifyURBDone.
+         Here it's started if that couldn't be done because both buffers were full, or resubmitted if the
+         device NAKed it or it failed. The HCD halts an interrupt channel in these cases and reports
+         URB_NOTREADY or URB_ERROR without re-enabling it, so the transfer is retried once per poll interval.
+         While the transfer is in flight, the URB state stays URB_IDLE. */
+      USBH_URBStateTypeDef URBState = USBH_LL_GetURBState(phost, HID_Handle->InPipe);
+
+      if ((HID_Handle->RxPending == 0U) ? ((uint8_t)(HID_Handle->RxCount - HID_Handle->DoneCount) < 2U) :
+          ((URBState == USBH_URB_NOTREADY) || (URBState == USBH_URB_ERROR)))
+      {
+        HID_Handle->RxPending = 1U;
+        USBH_HID_StartInTransfer(phost);
+      }
     }
   }
   return USBH_OK;
 }
 
+/**
+  * @brief  USBH_HID_StartInTransfer
+  *         The function starts the next IN transfer of the keyboard/mouse
+  *         interface into the buffer that is due for it
+  * @param  phost: Host handle
+  * @retval None
+  */
+static void USBH_HID_StartInTransfer(USBH_HandleTypeDef *phost)
+{
+  HID_HandleTypeDef *HID_Handle = (HID_HandleTypeDef *) phost->pActiveClass->pData;
+  uint8_t buffer = HID_Handle->RxCount & 1U;
+
+  HID_Handle->timer = phost->Timer;
+  (void)USBH_InterruptReceiveData(phost, HID_Handle->pRxBuffers[buffer],
+                                  (uint8_t)HID_Handle->length,
+                                  HID_Handle->InPipe);
+}
+
+/**
+  * @brief  USBH_HID_NotifyURBDone
+  *         The function is called from the host controller interrupt when a
+  *         transfer on a pipe completes. For the IN pipe of the keyboard/mouse
+  *         interface, it starts the next transfer into the other buffer if
+  *         the report that was there has been processed.
+  *         In HID_POLL, the IN pipe is only submitted from the host controller
+  *         interrupt (here and in USBH_HID_SOFProcess), never from the main
+  *         loop. The main loop submits the auxiliary IN pipe and control
+  *         transfers on other channels, which only share the OTG global
+  *         registers with it, and the HCD touches none of them when starting
+  *         an IN transfer. USBH_HID_Process only resubmits the IN pipe after
+  *         leaving HID_POLL, when these functions leave it alone.
+  * @param  phost: Host handle
+  * @param  pipe: Pipe of the transfer
+  * @retval None
+  */
+void USBH_HID_NotifyURBDone(USBH_HandleTypeDef *phost, uint8_t pipe)
+{
+  HID_HandleTypeDef *HID_Handle;
+
+  if ((phost->pActiveClass == NULL) || (phost->pActiveClass->pData == NULL))
+  {
+    return;
+  }
+
+  HID_Handle = (HID_HandleTypeDef *) phost->pActiveClass->pData;
+  if ((HID_Handle->state != HID_POLL) || (pipe != HID_Handle->InPipe) || (HID_Handle->RxPending == 0U))
+  {
+    return;
+  }
+
+  HID_Handle->RxLength[HID_Handle->RxCount & 1U] = (uint16_t)USBH_LL_GetLastXferSize(phost, pipe);
+  HID_Handle->RxTimer[HID_Handle->RxCount & 1U] = phost->Timer;
+  HID_Handle->RxCount++;
+
+  if ((uint8_t)(HID_Handle->RxCount - HID_Handle->DoneCount) < 2U)
+  {
+    USBH_HID_StartInTransfer(phost);
+  }
+  else
+  {
+    HID_Handle->RxPending = 0U;
+  }
+}
+
+/**
+  * @brief  USBH_HID_AuxProcess
+  *         The function polls the IN endpoint of the auxiliary interface
+  *         and passes the reports received to USBH_HID_AuxReportCallback
+  * @param  phost: Host handle
+  * @retval None
+  */
+static void USBH_HID_AuxProcess(USBH_HandleTypeDef *phost)
+{
+  HID_HandleTypeDef *HID_Handle = (HID_HandleTypeDef *) phost->pActiveClass->pData;
+  uint32_t XferSize;
+
+  if (HID_Handle->AuxInPipe == 0U)
+  {
+    return;
+  }
+
+  if ((HID_Handle->AuxDataReady == 0U) &&
+      (USBH_LL_GetURBState(phost, HID_Handle->AuxInPipe) == USBH_URB_DONE))
+  {
+    HID_Handle->AuxDataReady = 1U;
+    XferSize = USBH_LL_GetLastXferSize(phost, HID_Handle->AuxInPipe);
+    if (XferSize != 0U)
+    {
+      USBH_HID_AuxReportCallback(phost, HID_Handle->AuxData, (uint16_t)XferSize);
+    }
+  }
+
+  if ((phost->Timer - HID_Handle->AuxTimer) >= HID_Handle->AuxPoll)
+  {
+    USBH_InterruptReceiveData(phost, HID_Handle->AuxData,
+                              (uint8_t)HID_Handle->AuxLength,
+                              HID_Handle->AuxInPipe);
+    HID_Handle->AuxTimer = phost->Timer;
+    HID_Handle->AuxDataReady = 0U;
+  }
+}
+
 /**
 * @brief  USBH_Get_HID_ReportDescriptor
   *         Issue report Descriptor command to the device. Once the response
@@ -553,6 +772,31 @@ USBH_StatusTypeDef USBH_HID_GetHIDReportDescriptor(USBH_HandleTypeDef *phost,
   return status;
 }
 
+/**
+  * @brief  USBH_HID_GetAuxReportDescriptor
+  *         Issue report Descriptor command for the auxiliary interface.
+  *         The descriptor is received into phost->device.Data.
+  * @param  phost: Host handle
+  * @param  length : HID Report Descriptor Length
+  * @retval USBH Status
+  */
+static USBH_StatusTypeDef USBH_HID_GetAuxReportDescriptor(USBH_HandleTypeDef *phost,
+                                                          uint16_t length)
+{
+  HID_HandleTypeDef *HID_Handle = (HID_HandleTypeDef *) phost->pActiveClass->pData;
+
+  if (phost->RequestState == CMD_SEND)
+  {
+    phost->Control.setup.b.bmRequestType = USB_D2H | USB_REQ_RECIPIENT_INTERFACE | USB_REQ_TYPE_STANDARD;
+    phost->Control.setup.b.bRequest = USB_REQ_GET_DESCRIPTOR;
+    phost->Control.setup.b.wValue.w = USB_DESC_HID_REPORT;
+    phost->Control.setup.b.wIndex.w = phost->device.CfgDesc.Itf_Desc[HID_Handle->AuxInterface].bInterfaceNumber;
+    phost->Control.setup.b.wLength.w = length;
+  }
+
+  return USBH_CtlReq(phost, phost->device.Data, length);
+}
+
 /**
   * @brief  USBH_Get_HID_Descriptor
   *         Issue HID Descriptor command to the device. Once the response
@@ -691,13 +935,15 @@ USBH_StatusTypeDef USBH_HID_SetProtocol(USBH_HandleTypeDef *phost,
   *         This function Parse the HID descriptor
   * @param  desc: HID Descriptor
   * @param  buf: Buffer where the source descriptor is available
+  * @param  interface: Number of the interface the descriptor belongs to
   * @retval None
   */
-static void  USBH_HID_ParseHIDDesc(HID_DescTypeDef *desc, uint8_t *buf)
+static void  USBH_HID_ParseHIDDesc(HID_DescTypeDef *desc, uint8_t *buf, uint8_t interface)
 {
   USBH_DescHeader_t *pdesc = (USBH_DescHeader_t *)buf;
   uint16_t CfgDescLen;
   uint16_t ptr;
+  uint8_t currentInterface = 0xFFU;
 
   CfgDescLen = LE16(buf + 2U);
 
@@ -709,7 +955,12 @@ static void  USBH_HID_ParseHIDDesc(HID_DescTypeDef *desc, uint8_t *buf)
     {
       pdesc = USBH_GetNextDesc((uint8_t *)pdesc, &ptr);
 
-      if (pdesc->bDescriptorType == USB_DESC_TYPE_HID)
+      if (pdesc->bDescriptorType == USB_DESC_TYPE_INTERFACE)
+      {
+        currentInterface = *(uint8_t *)((uint8_t *)pdesc + 2U);
+      }
+
+      if ((pdesc->bDescriptorType == USB_DESC_TYPE_HID) && (currentInterface == interface))
       {
         desc->bLength = *(uint8_t *)((uint8_t *)pdesc + 0U);
         desc->bDescriptorType = *(uint8_t *)((uint8_t *)pdesc + 1U);
@@ -884,14 +1135,75 @@ uint16_t USBH_HID_FifoWrite(FIFO_TypeDef *f, void *buf, uint16_t  nbytes)
 }
 
 /**
-* @brief  The function is a callback about HID Data events
+* @brief  The function is a callback about HID Data events. The report is in
+*         HID_Handle->pData, DataLength bytes long, and the buffer is not
+*         reused until the callback returns, i.e. it can be processed in place. By default it's queued into the HID FIFO for
+*         USBH_HID_GetKeybdInfo() and USBH_HID_GetMouseInfo().
 *  @param  phost: Selected device
 * @retval None
 */
 __weak void USBH_HID_EventCallback(USBH_HandleTypeDef *phost)
+{
+  HID_HandleTypeDef *HID_Handle = (HID_HandleTypeDef *) phost->pActiveClass->pData;
+
+  USBH_HID_FifoWrite(&HID_Handle->fifo, HID_Handle->pData, HID_Handle->length);
+}
+
+/**
+* @brief  The function is called when the report descriptor has been fetched
+*  @param  phost: Selected device
+*  @param  desc: Report descriptor
+*  @param  length: Length of the descriptor
+* @retval Protocol to select: HID_BOOT_PROTOCOL or HID_REPORT_PROTOCOL
+*/
+__weak uint8_t USBH_HID_ReportDescriptorCallback(USBH_HandleTypeDef *phost,
+                                                 const uint8_t *desc,
+                                                 uint16_t length)
+{
+  /* Prevent unused argument(s) compilation warning */
+  UNUSED(phost);
+  UNUSED(desc);
+  UNUSED(length);
+
+  return HID_BOOT_PROTOCOL;
+}
+
+/**
+* @brief  The function is called when the report descriptor of the auxiliary
+*         interface has been fetched
+*  @param  phost: Selected device
+*  @param  desc: Report descriptor
+*  @param  length: Length of the descriptor
+* @retval Nonzero to poll the interface, zero to ignore it
+*/
+__weak uint8_t USBH_HID_AuxReportDescriptorCallback(USBH_HandleTypeDef *phost,
+                                                    const uint8_t *desc,
+                                                    uint16_t length)
+{
+  /* Prevent unused argument(s) compilation warning */
+  UNUSED(phost);
+  UNUSED(desc);
+  UNUSED(length);
+
+  return 0U;
+}
+
+/**
+* @brief  The function is called with each report received from the
+*         auxiliary interface
+*  @param  phost: Selected device
+*  @param  report: Report data
+*  @param  length: Length of the report
+* @retval None
+*/
+__weak void USBH_HID_AuxReportCallback(USBH_HandleTypeDef *phost,
+                                       const uint8_t *report,
+                                       uint16_t length)
 {
   /* Prevent unused argument(s) compilation warning */
   UNUSED(phost);
+  UNUSED(report);
+  UNUSED(length);
 }
 /**
 * @}
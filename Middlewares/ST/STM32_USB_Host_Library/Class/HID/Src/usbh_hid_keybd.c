@@ -94,8 +94,8 @@ static USBH_StatusTypeDef USBH_HID_KeybdDecode(USBH_HandleTypeDef *phost);
 */
 
 HID_KEYBD_Info_TypeDef     keybd_info;
-uint32_t                   keybd_rx_report_buf[2];
-uint32_t                   keybd_report_data[2];
+uint32_t                   keybd_rx_report_buf[2][HID_KEYBD_MAX_REPORT_SIZE / sizeof(uint32_t)];
+uint32_t                   keybd_report_data[HID_KEYBD_MAX_REPORT_SIZE / sizeof(uint32_t)];
 
 static const HID_Report_ItemTypedef imp_0_lctrl =
 {
@@ -339,15 +339,18 @@ USBH_StatusTypeDef USBH_HID_KeybdInit(USBH_HandleTypeDef *phost)
   for (x = 0U; x < (sizeof(keybd_report_data) / sizeof(uint32_t)); x++)
   {
     keybd_report_data[x] = 0U;
-    keybd_rx_report_buf[x] = 0U;
+    keybd_rx_report_buf[0][x] = 0U;
+    keybd_rx_report_buf[1][x] = 0U;
   }
 
   if (HID_Handle->length > (sizeof(keybd_report_data)))
   {
     HID_Handle->length = (sizeof(keybd_report_data));
   }
-  HID_Handle->pData = (uint8_t *)(void *)keybd_rx_report_buf;
-  USBH_HID_FifoInit(&HID_Handle->fifo, phost->device.Data, HID_QUEUE_SIZE * sizeof(keybd_report_data));
+  HID_Handle->pRxBuffers[0] = (uint8_t *)(void *)keybd_rx_report_buf[0];
+  HID_Handle->pRxBuffers[1] = (uint8_t *)(void *)keybd_rx_report_buf[1];
+  HID_Handle->pData = HID_Handle->pRxBuffers[0];
+  USBH_HID_FifoInit(&HID_Handle->fifo, phost->device.Data, HID_QUEUE_SIZE * HID_Handle->length);
 
   return USBH_OK;
 }
@@ -84,7 +84,7 @@ static USBH_StatusTypeDef USBH_HID_MouseDecode(USBH_HandleTypeDef *phost);
   */
 HID_MOUSE_Info_TypeDef    mouse_info;
 uint32_t                  mouse_report_data[2];
-uint32_t                  mouse_rx_report_buf[2];
+uint32_t                  mouse_rx_report_buf[2][2];
 
 /* Structures defining how to access items in a HID mouse report */
 /* Access button 1 state. */
@@ -192,14 +192,17 @@ USBH_StatusTypeDef USBH_HID_MouseInit(USBH_HandleTypeDef *phost)
   for (i = 0U; i < (sizeof(mouse_report_data) / sizeof(uint32_t)); i++)
   {
     mouse_report_data[i] = 0U;
-    mouse_rx_report_buf[i] = 0U;
+    mouse_rx_report_buf[0][i] = 0U;
+    mouse_rx_report_buf[1][i] = 0U;
   }
 
   if (HID_Handle->length > sizeof(mouse_report_data))
   {
     HID_Handle->length = sizeof(mouse_report_data);
   }
-  HID_Handle->pData = (uint8_t *)(void *)mouse_rx_report_buf;
+  HID_Handle->pRxBuffers[0] = (uint8_t *)(void *)mouse_rx_report_buf[0];
+  HID_Handle->pRxBuffers[1] = (uint8_t *)(void *)mouse_rx_report_buf[1];
+  HID_Handle->pData = HID_Handle->pRxBuffers[0];
   USBH_HID_FifoInit(&HID_Handle->fifo, phost->device.Data, HID_QUEUE_SIZE * sizeof(mouse_report_data));
 
   return USBH_OK;
@@ -0,0 +1,141 @@
+// Compares RingBuffer with PowerOfTwoRingBuffer on the workload of keyboardBuffer in ps2-kbd-emulator.cpp:
+// length-prefixed scan codes are appended, then read by index and removed from the front one at a time.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "RingBuffer.hpp"
+
+constexpr unsigned CAPACITY=32;
+constexpr unsigned NUM_ROUNDS=20'000'000;
+
+// Scan codes of typical lengths, each preceded by its length, as passed to passByteToPS2()
+static const uint8_t scanCodes[][9]={
+    {1, 0x1C},
+    {2, 0xF0, 0x1C},
+    {2, 0xE0, 0x75},
+    {3, 0xE0, 0xF0, 0x75},
+    {4, 0xE0, 0x12, 0xE0, 0x7C},
+    {6, 0xE0, 0xF0, 0x7C, 0xE0, 0xF0, 0x12},
+    {8, 0xE1, 0x14, 0x77, 0xE1, 0xF0, 0x14, 0xF0, 0x77},
+};
+constexpr unsigned NUM_SCAN_CODES=sizeof scanCodes / sizeof scanCodes[0];
+// Scan codes kept in the buffer between being pushed and consumed, so that the indices keep wrapping around at
+// different offsets. There must always be room for one more.
+constexpr unsigned LAG=2;
+static_assert((LAG+1)*sizeof scanCodes[0] <= CAPACITY);
+
+static void fail(const char* name, const char* what)
+{
+    fprintf(stderr, "%s: %s\n", name, what);
+    exit(1);
+}
+
+// Depends on the order of the bytes, so that equal checksums mean equal sequences in practice
+static uint32_t addToChecksum(const uint32_t checksum, const uint8_t byte)
+{
+    return checksum*31 + byte;
+}
+
+// What consuming the scan codes of all the rounds must yield
+static uint32_t expectedChecksum()
+{
+    uint32_t checksum=0;
+    for(unsigned round=0; round<NUM_ROUNDS; ++round)
+    {
+        const auto& code=scanCodes[round%NUM_SCAN_CODES];
+        for(unsigned n=0; n<code[0]; ++n)
+            checksum=addToChecksum(checksum, code[n+1]);
+    }
+    return checksum;
+}
+
+// The way the original buffer is used: a byte at a time. Returns the checksum of the bytes consumed, or fails if
+// a scan code doesn't fit.
+template<typename Buffer>
+static uint32_t runPerByte(const char* name, Buffer& buffer)
+{
+    uint32_t checksum=0;
+    for(unsigned round=0; round<NUM_ROUNDS; ++round)
+    {
+        const auto& code=scanCodes[(round+LAG)%NUM_SCAN_CODES];
+        for(unsigned n=0; n<code[0]+1u; ++n)
+            if(!buffer.push_back(code[n]))
+                fail(name, "push_back() failed");
+        const unsigned count=buffer[0];
+        for(unsigned n=0; n<count; ++n)
+            checksum=addToChecksum(checksum, buffer[n+1]);
+        for(unsigned n=0; n<count+1; ++n)
+            buffer.pop_front();
+    }
+    return checksum;
+}
+
+template<typename Buffer>
+static uint32_t runBulk(const char* name, Buffer& buffer)
+{
+    uint32_t checksum=0;
+    for(unsigned round=0; round<NUM_ROUNDS; ++round)
+    {
+        const auto& code=scanCodes[(round+LAG)%NUM_SCAN_CODES];
+        if(!buffer.push(code, code[0]+1u))
+            fail(name, "push() failed");
+        const unsigned count=buffer[0];
+        for(unsigned n=0; n<count; ++n)
+            checksum=addToChecksum(checksum, buffer[n+1]);
+        buffer.drop(count+1);
+    }
+    return checksum;
+}
+
+// Checksum of what is left in the buffer, so that all the variants can be checked to end in the same state
+template<typename Buffer>
+static uint32_t remainingChecksum(Buffer& buffer)
+{
+    uint32_t checksum=buffer.size();
+    for(unsigned n=0; n<buffer.size(); ++n)
+        checksum=addToChecksum(checksum, buffer[n]);
+    return checksum;
+}
+
+template<typename Buffer, typename Run>
+static double measure(const char* name, Buffer& buffer, Run run, const uint32_t expectedConsumed,
+                      uint32_t& remaining)
+{
+    // The first scan codes are consumed by the first rounds
+    for(unsigned round=0; round<LAG; ++round)
+    {
+        const auto& code=scanCodes[round%NUM_SCAN_CODES];
+        for(unsigned n=0; n<code[0]+1u; ++n)
+            if(!buffer.push_back(code[n]))
+                fail(name, "pre-filling failed");
+    }
+
+    const auto start=std::chrono::steady_clock::now();
+    const uint32_t consumed=run(name, buffer);
+    const auto end=std::chrono::steady_clock::now();
+    if(consumed!=expectedConsumed)
+        fail(name, "consumed bytes differ from the scan codes pushed");
+    remaining=remainingChecksum(buffer);
+    const double ns=std::chrono::duration<double, std::nano>(end-start).count()/NUM_ROUNDS;
+    printf("%-36s %6.2f ns per scan code\n", name, ns);
+    return ns;
+}
+
+int main()
+{
+    static RingBuffer<CAPACITY> original;
+    static PowerOfTwoRingBuffer<CAPACITY> masked, maskedBulk;
+
+    const uint32_t expected=expectedChecksum();
+    uint32_t baseRemaining, perByteRemaining, bulkRemaining;
+    const double base=measure("RingBuffer, per byte", original, runPerByte<decltype(original)>,
+                              expected, baseRemaining);
+    const double perByte=measure("PowerOfTwoRingBuffer, per byte", masked, runPerByte<decltype(masked)>,
+                                 expected, perByteRemaining);
+    const double bulk=measure("PowerOfTwoRingBuffer, push()/drop()", maskedBulk, runBulk<decltype(maskedBulk)>,
+                              expected, bulkRemaining);
+    if(perByteRemaining!=baseRemaining || bulkRemaining!=baseRemaining)
+        fail("PowerOfTwoRingBuffer", "ends in a different state than RingBuffer");
+    printf("Speedup: %.2fx per byte, %.2fx bulk\n", base/perByte, base/bulk);
+}
@@ -53,3 +53,69 @@ public:
     bool empty() const { return size_==0; }
     constexpr unsigned capacity() const { return capacity_; }
 };
+
+// Same interface as RingBuffer, plus bulk operations. Capacity must be a power of two, so that indices can be
+// wrapped by masking instead of branching. Start and end are free-running counters, their difference being
+// the size.
+template<unsigned capacity_, typename Type=uint8_t>
+class PowerOfTwoRingBuffer
+{
+    static_assert(capacity_ && (capacity_&(capacity_-1))==0, "Capacity must be a power of two");
+    static constexpr unsigned MASK=capacity_-1;
+
+    Type buffer_[capacity_];
+    unsigned start_=0, end_=0;
+public:
+    bool push_back(const Type x)
+    {
+        if(size()>=capacity_) return false;
+        buffer_[end_++ & MASK]=x;
+        return true;
+    }
+    // Either pushes all of the values or, if there's not enough room for them, none
+    bool push(const Type* values, const unsigned count)
+    {
+        if(capacity_-size() < count) return false;
+        for(unsigned n=0; n<count; ++n)
+            buffer_[(end_+n) & MASK]=values[n];
+        end_+=count;
+        return true;
+    }
+    void clear()
+    {
+        start_=end_;
+    }
+
+    Type& operator[](unsigned i)       { return buffer_[(start_+i) & MASK]; }
+    Type  operator[](unsigned i) const { return buffer_[(start_+i) & MASK]; }
+
+    Type& back()       { return (*this)[size()-1]; }
+    Type  back() const { return (*this)[size()-1]; }
+
+    Type& front()       { return (*this)[0]; }
+    Type  front() const { return (*this)[0]; }
+
+    Type pop_front()
+    {
+        if(empty()) return {};
+        return buffer_[start_++ & MASK];
+    }
+    // Removes min(count, size()) elements from the front
+    void drop(unsigned count)
+    {
+        if(count>size()) count=size();
+        start_+=count;
+    }
+    // Removes i-th element, shifting the following ones towards the front
+    void erase(const unsigned i)
+    {
+        if(i>=size()) return;
+        for(unsigned n=i; n+1<size(); ++n)
+            (*this)[n]=(*this)[n+1];
+        --end_;
+    }
+
+    unsigned size() const { return end_-start_; }
+    bool empty() const { return start_==end_; }
+    constexpr unsigned capacity() const { return capacity_; }
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+
+// Lock-free queue for passing data from one context to another, e.g. from the main loop to an ISR or back.
+// Only one context may call producer methods, and only one (other) context may call consumer methods.
+// Neither of them needs to mask interrupts: each index is written by only one side, and the release store
+// of an index publishes the elements written (or frees the elements read) before it.
+template<unsigned capacity_, typename Type=uint8_t>
+class SPSCQueue
+{
+    static_assert(capacity_ && (capacity_&(capacity_-1))==0, "Capacity must be a power of two");
+    static_assert(std::atomic<unsigned>::is_always_lock_free);
+
+    Type buffer_[capacity_];
+    // Free-running counters, wrapped to buffer indices by masking. Their difference is the current size.
+    std::atomic<unsigned> head_{0}; // Written by the producer
+    std::atomic<unsigned> tail_{0}; // Written by the consumer
+public:
+    // Producer methods
+
+    // Either pushes all of the values or, if there's not enough room for them, none
+    bool push(const Type* values, const unsigned count)
+    {
+        const auto head=head_.load(std::memory_order_relaxed);
+        const auto tail=tail_.load(std::memory_order_acquire);
+        if(capacity_-(head-tail) < count) return false;
+        for(unsigned n=0; n<count; ++n)
+            buffer_[(head+n)&(capacity_-1)]=values[n];
+        head_.store(head+count, std::memory_order_release);
+        return true;
+    }
+    bool push(const Type value)
+    {
+        return push(&value, 1);
+    }
+    bool full() const
+    {
+        return head_.load(std::memory_order_relaxed)-tail_.load(std::memory_order_acquire) == capacity_;
+    }
+
+    // Consumer methods
+
+    // Must not be called if the queue is empty
+    Type front() const
+    {
+        return buffer_[tail_.load(std::memory_order_relaxed)&(capacity_-1)];
+    }
+    bool pop(Type& value)
+    {
+        const auto tail=tail_.load(std::memory_order_relaxed);
+        if(head_.load(std::memory_order_acquire)==tail) return false;
+        value=buffer_[tail&(capacity_-1)];
+        tail_.store(tail+1, std::memory_order_release);
+        return true;
+    }
+    void pop()
+    {
+        Type value;
+        pop(value);
+    }
+    void clear()
+    {
+        tail_.store(head_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // Can be called from either side
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire)==tail_.load(std::memory_order_acquire);
+    }
+    unsigned size() const
+    {
+        return head_.load(std::memory_order_acquire)-tail_.load(std::memory_order_acquire);
+    }
+    constexpr unsigned capacity() const { return capacity_; }
+};
@@ -1,24 +1,11 @@
 #include <stdbool.h>
 #include "usbh_core.h"
 #include "usbh_hid_keybd.h"
-#include "scancodes2.h"
 #include "ps2-kbd-emulator.h"
-
-void emitScanCode(const uint8_t* code)
-{
-    const unsigned N=code[0];
-    if(N==0) return;
-    for(unsigned n=0; n<=N; ++n)
-        passByteToPS2(code[n]);
-}
-
-typedef enum
-{
-    TM_IDLE,
-    TM_DELAY,
-    TM_REPEAT,
-} TypematicMode;
-TypematicMode typematicMode=TM_IDLE;
+#include "pipeline-stats.h"
+#include "hid-report-layout.h"
+#include "scancodes2.h"
+#include "typematic.h"
 
 typedef enum
 {
@@ -41,11 +28,23 @@ void setUSBKeyboardLEDs(uint8_t leds)
     emuState.ledsUpdated=true;
 }
 
-void processUSBKeyboardEvent(const uint8_t key, const KeyState state)
+#define KEY_BUF_SIZE (6+8) // 6 keys and 8 modifiers of a boot protocol report
+
+// Events generated from one report (presses and releases of all the keys), or a typematic repeat.
+// They are passed to the PS/2 side together.
+static KeyEvent pendingEvents[2*KEY_BUF_SIZE+1];
+static unsigned numPendingEvents;
+
+static void flushPendingEvents(void)
 {
-    const bool numLockLED = emuState.leds&1;
+    if(!numPendingEvents) return;
+    passKeyEventsToPS2(pendingEvents, numPendingEvents);
+    numPendingEvents=0;
+}
 
-    const uint8_t* scancode=NULL;
+void processUSBKeyboardEvent(const uint8_t key, const KeyState state)
+{
+    KeyEvent event={.key=key, .flags=0};
     switch(state)
     {
     case KS_UP:
@@ -55,7 +54,7 @@ void processUSBKeyboardEvent(const uint8_t key, const KeyState state)
             emuState.shift=false;
         else if(key==KEY_LEFTALT || key==KEY_RIGHTALT)
             emuState.alt=false;
-        scancode=keyToBreakCode(key, emuState.ctrl, emuState.shift, emuState.alt, numLockLED);
+        event.flags |= KEY_EVENT_BREAK;
         break;
     case KS_DOWN:
     case KS_AUTOREPEAT:
@@ -65,53 +64,151 @@ void processUSBKeyboardEvent(const uint8_t key, const KeyState state)
             emuState.shift=true;
         else if(key==KEY_LEFTALT || key==KEY_RIGHTALT)
             emuState.alt=true;
-        scancode=keyToMakeCode(key, emuState.ctrl, emuState.shift, emuState.alt, numLockLED, state==KS_AUTOREPEAT);
+        if(state==KS_AUTOREPEAT)
+            event.flags |= KEY_EVENT_AUTOREPEAT;
         break;
     }
-    emitScanCode(scancode);
+    if(emuState.ctrl)  event.flags |= KEY_EVENT_CTRL;
+    if(emuState.shift) event.flags |= KEY_EVENT_SHIFT;
+    if(emuState.alt)   event.flags |= KEY_EVENT_ALT;
+    if(emuState.leds&1) event.flags |= KEY_EVENT_NUM_LOCK;
+    ++pipelineStats.keyEvents;
+    // An NKRO report can change more keys than fit, then they are passed in several batches
+    if(numPendingEvents == sizeof pendingEvents / sizeof pendingEvents[0])
+        flushPendingEvents();
+    pendingEvents[numPendingEvents++]=event;
 }
 
+// Set of pressed keys as a bitmap indexed by usage ID
+#define KEY_BITMAP_WORDS (256/32)
 typedef struct
 {
-    uint8_t lctrl : 1;
-    uint8_t lshift : 1;
-    uint8_t lalt : 1;
-    uint8_t lgui : 1;
-    uint8_t rctrl : 1;
-    uint8_t rshift : 1;
-    uint8_t ralt : 1;
-    uint8_t rgui : 1;
-    uint8_t reserved;
-    uint8_t keys[6];
-} USBKeyboardReport;
-
-#define KEY_BUF_SIZE (6+8) // 6 for keys[], 8 for the ones in the bitmap
-static uint8_t pressedKeysUSB[KEY_BUF_SIZE];
-static uint8_t lastPressedKey;
-
-void addPressedKey(uint8_t *keys, const uint8_t key)
-{
-    for(unsigned n=0; n<KEY_BUF_SIZE; ++n)
+    uint32_t words[KEY_BITMAP_WORDS];
+} KeyBitmap;
+
+static KeyBitmap pressedKeysUSB;
+
+// Layout of the reports in the protocol selected for the device
+static HIDReportLayout compiledReportLayout;
+static const HIDReportLayout* reportLayout=&hidBootKeyboardLayout;
+// Layout of the reports of another HID interface of the device, used for Consumer and System Control keys
+static HIDReportLayout auxReportLayout;
+
+// Frame in which the IN transfer of the previous keyboard report completed
+static uint32_t lastReportFrame;
+static bool lastReportFrameKnown;
+
+// Kinds of keys a report can have fields for. A report only changes the state of the keys of the kinds
+// it has fields for, so that e.g. a consumer control report doesn't release the keyboard keys.
+enum
+{
+    KEY_GROUP_KEYBOARD=1<<0,
+    KEY_GROUP_CONSUMER=1<<1,
+    KEY_GROUP_SYSTEM  =1<<2,
+};
+
+static unsigned keyGroupOfUsagePage(const unsigned usagePage)
+{
+    switch(usagePage)
     {
-        if(keys[n]) continue;
+    case HID_USAGE_PAGE_KEYBOARD: return KEY_GROUP_KEYBOARD;
+    case HID_USAGE_PAGE_CONSUMER: return KEY_GROUP_CONSUMER;
+    default:                      return KEY_GROUP_SYSTEM;
+    }
+}
 
-        keys[n]=key;
-        return;
+// Bits of the keys first..last within the given word of a KeyBitmap
+static uint32_t keyRangeWordMask(const unsigned first, const unsigned last, const unsigned word)
+{
+    const unsigned low=32*word, high=low+31;
+    if(last<low || first>high) return 0;
+    const unsigned from = first>low ? first-low : 0;
+    const unsigned to = last<high ? last-low : 31;
+    return (UINT32_MAX >> (31-to)) & (UINT32_MAX << from);
+}
+
+static uint32_t keyGroupsWordMask(const unsigned groups, const unsigned word)
+{
+    uint32_t mask=0;
+    if(groups & KEY_GROUP_KEYBOARD)
+        mask |= keyRangeWordMask(KEY_NONE, KEY_RIGHT_GUI, word);
+    if(groups & KEY_GROUP_CONSUMER)
+        mask |= keyRangeWordMask(KEY_CONSUMER_FIRST, KEY_CONSUMER_LAST, word);
+    if(groups & KEY_GROUP_SYSTEM)
+        mask |= keyRangeWordMask(KEY_SYSTEM_FIRST, KEY_SYSTEM_LAST, word);
+    return mask;
+}
+
+static void addPressedKey(KeyBitmap* bitmap, const unsigned usagePage, const unsigned usage)
+{
+    if(usage==0) return; // Means no key on all the pages
+    const unsigned key = usagePage==HID_USAGE_PAGE_KEYBOARD ? usage : hidUsageToKey(usagePage, usage);
+    if(key==KEY_NONE || key>=32*KEY_BITMAP_WORDS) return;
+    bitmap->words[key/32] |= 1ul<<(key%32);
+}
+
+// Fills the bitmap from the fields of the report. Returns the groups of keys the report has fields for.
+static unsigned decodeReport(const HIDReportLayout*const layout, const uint8_t* report, unsigned length,
+                             KeyBitmap* keys)
+{
+    uint8_t reportID=0;
+    if(layout->usesReportIDs)
+    {
+        if(!length) return 0;
+        reportID=*report++;
+        --length;
     }
+
+    unsigned groups=0;
+    for(unsigned f=0; f<layout->numFields; ++f)
+    {
+        const HIDReportField*const field=&layout->fields[f];
+        if(field->reportID!=reportID || field->bitOffset+field->count*field->bitSize > 8*length)
+            continue;
+        groups |= keyGroupOfUsagePage(field->usagePage);
+
+        if(field->isArray)
+        {
+            const uint32_t numUsages=field->usageMax-field->usageMin+1;
+            for(unsigned n=0; n<field->count; ++n)
+            {
+                const uint32_t index=HIDReportLayout_ReadElement(field, report, n)-field->logicalMin;
+                if(index<numUsages)
+                    addPressedKey(keys, field->usagePage, field->usageMin+index);
+            }
+        }
+        else if(field->bitSize==1 && field->bitOffset%8==0)
+        {
+            // Key bitmap of an NKRO keyboard or the modifier byte: only visit the bits that are set
+            const uint8_t*const bytes=report+field->bitOffset/8;
+            for(unsigned n=0; n<field->count; n+=8)
+            {
+                unsigned bits=bytes[n/8];
+                if(field->count-n < 8)
+                    bits &= (1u<<(field->count-n))-1;
+                for(; bits; bits&=bits-1)
+                    addPressedKey(keys, field->usagePage, field->usageMin+n+__builtin_ctz(bits));
+            }
+        }
+        else
+        {
+            for(unsigned n=0; n<field->count; ++n)
+                if(HIDReportLayout_ReadElement(field, report, n))
+                    addPressedKey(keys, field->usagePage, field->usageMin+n);
+        }
+    }
+    return groups;
 }
 
-void startTypematicDelay()
+static unsigned typematicSlotOfKey(const uint8_t key)
 {
-    autorepeatTickCounter=0;
-    typematicMode=TM_DELAY;
+    return key>=KEY_CONSUMER_FIRST ? TYPEMATIC_SLOT_CONTROL : TYPEMATIC_SLOT_KEYBOARD;
 }
 
 void keyPressed(const uint8_t key)
 {
-    lastPressedKey=key;
-    startTypematicDelay();
+    Typematic_KeyPressed(typematicSlotOfKey(key), key);
 
-    addPressedKey(pressedKeysUSB, key);
     processUSBKeyboardEvent(key, KS_DOWN);
 }
 
@@ -122,17 +219,49 @@ void keyRepeated(const uint8_t key)
 
 void keyReleased(const uint8_t key)
 {
-    lastPressedKey=0;
-    typematicMode=TM_IDLE;
+    Typematic_KeyReleased(typematicSlotOfKey(key), key);
+
+    processUSBKeyboardEvent(key, KS_UP);
+}
 
-    for(unsigned n=0; n<KEY_BUF_SIZE; ++n)
+// Generates the events for the keys that differ between the previous and the current state. Only the changed
+// bits are visited, so the cost doesn't depend on how many keys are held.
+static void processKeyStateChanges(const KeyBitmap* current)
+{
+    for(unsigned n=0; n<KEY_BITMAP_WORDS; ++n)
     {
-        if(pressedKeysUSB[n]!=key)
-            continue;
-        pressedKeysUSB[n]=0;
-        break;
+        for(uint32_t pressed=current->words[n] & ~pressedKeysUSB.words[n]; pressed;)
+        {
+            const unsigned bit=31-__builtin_clz(pressed); // Compiles to CLZ
+            pressed &= ~(1ul<<bit);
+            keyPressed(n*32+bit);
+        }
     }
-    processUSBKeyboardEvent(key, KS_UP);
+    for(unsigned n=0; n<KEY_BITMAP_WORDS; ++n)
+    {
+        for(uint32_t released=pressedKeysUSB.words[n] & ~current->words[n]; released;)
+        {
+            const unsigned bit=31-__builtin_clz(released);
+            released &= ~(1ul<<bit);
+            keyReleased(n*32+bit);
+        }
+    }
+    pressedKeysUSB=*current;
+}
+
+static void processReport(const HIDReportLayout* layout, const uint8_t* report, const unsigned length)
+{
+    KeyBitmap decoded={{0}};
+    const unsigned groups=decodeReport(layout, report, length, &decoded);
+    if(!groups) return;
+
+    KeyBitmap current;
+    for(unsigned n=0; n<KEY_BITMAP_WORDS; ++n)
+    {
+        const uint32_t mask=keyGroupsWordMask(groups, n);
+        current.words[n] = (pressedKeysUSB.words[n] & ~mask) | (decoded.words[n] & mask);
+    }
+    processKeyStateChanges(&current);
 }
 
 static void doSetLEDs(USBH_HandleTypeDef *phost)
@@ -170,16 +299,109 @@ static void doSetLEDs(USBH_HandleTypeDef *phost)
                 state & HID_CAPS_LOCK ? "on" : "off",
                 state & HID_SCROLL_LOCK ? "on" : "off");
 
+    // With report IDs, the ID goes both into the request and before the data
+    const uint8_t reportID=reportLayout->ledReportID;
+    uint8_t data[2]={reportID, state};
+    const unsigned offset = reportLayout->usesReportIDs ? 0 : 1;
+
     USBH_StatusTypeDef result;
     do
     {
-        result=USBH_HID_SetReport(phost, REPORT_OUTPUT, 0, &state, 1);
+        result=USBH_HID_SetReport(phost, REPORT_OUTPUT, reportID, data+offset, sizeof data-offset);
     }
     while(result==USBH_BUSY);
     if(result!=USBH_OK)
         USBH_UsrLog("Failed to Set_Report: error %u", (unsigned)result);
 }
 
+static bool hasKeyboardFields(const HIDReportLayout* layout)
+{
+    for(unsigned n=0; n<layout->numFields; ++n)
+        if(layout->fields[n].usagePage==HID_USAGE_PAGE_KEYBOARD)
+            return true;
+    return false;
+}
+
+// Called by the HID class driver with the report descriptor, which is only available before the class is
+// initialized. Returns the protocol to select.
+uint8_t USBH_HID_ReportDescriptorCallback(USBH_HandleTypeDef *phost, const uint8_t *desc, uint16_t length)
+{
+    lastReportFrameKnown=false; // A new keyboard
+    reportLayout=&hidBootKeyboardLayout;
+#ifdef ENABLE_HID_REPORT_PROTOCOL
+    const uint8_t interface=phost->device.current_interface;
+    if(phost->device.CfgDesc.Itf_Desc[interface].bInterfaceProtocol==HID_KEYBRD_BOOT_CODE &&
+       HIDReportLayout_Compile(&compiledReportLayout, desc, length, true) &&
+       hasKeyboardFields(&compiledReportLayout))
+    {
+        USBH_UsrLog("Using report protocol, %u keyboard fields%s", compiledReportLayout.numFields,
+                    compiledReportLayout.usesReportIDs ? " with report IDs" : "");
+        reportLayout=&compiledReportLayout;
+        return HID_REPORT_PROTOCOL;
+    }
+    USBH_UsrLog("Using boot protocol");
+#else
+    (void)phost;
+    (void)desc;
+    (void)length;
+#endif
+    return HID_BOOT_PROTOCOL;
+}
+
+// Called by the HID class driver for another HID interface of the device. Returns whether to poll it.
+uint8_t USBH_HID_AuxReportDescriptorCallback(USBH_HandleTypeDef *phost, const uint8_t *desc, uint16_t length)
+{
+    (void)phost;
+    if(!HIDReportLayout_Compile(&auxReportLayout, desc, length, false))
+        return 0;
+    USBH_UsrLog("Using %u consumer/system control fields of another interface", auxReportLayout.numFields);
+    return 1;
+}
+
+void USBH_HID_AuxReportCallback(USBH_HandleTypeDef *phost, const uint8_t *report, uint16_t length)
+{
+    (void)phost;
+    ++pipelineStats.hidReports;
+    processReport(&auxReportLayout, report, length);
+    flushPendingEvents();
+}
+
+static void measureReportTiming(USBH_HandleTypeDef *phost, const HID_HandleTypeDef* hidHandle)
+{
+    if(lastReportFrameKnown)
+        PipelineStats_CountReportInterval(hidHandle->DataTimer-lastReportFrame, hidHandle->poll);
+    lastReportFrame=hidHandle->DataTimer;
+    lastReportFrameKnown=true;
+
+    // hidHandle->DataTimer is the frame in which the IN transfer completed
+    const uint32_t frameStartCycles=usbhFrameStartCycles[hidHandle->DataTimer % USBH_FRAME_HISTORY];
+    const uint32_t cycles=DWT->CYCCNT-frameStartCycles;
+    // The stamp is overwritten one frame before the history wraps around
+    if(phost->Timer-hidHandle->DataTimer >= USBH_FRAME_HISTORY-1)
+    {
+        ++pipelineStats.reportDelaysUnknown;
+        return;
+    }
+    PipelineStats_CountReportDelay(cycles/(SystemCoreClock/1000000));
+}
+
+// Called by the HID class driver in USBH_Process() for each report of the main interface. The report is
+// decoded right from its receive buffer, which isn't reused until this returns.
+void USBH_HID_EventCallback(USBH_HandleTypeDef *phost)
+{
+    if(USBH_HID_GetDeviceType(phost)!=HID_KEYBOARD)
+        return;
+
+    HID_HandleTypeDef*const hidHandle = (HID_HandleTypeDef*)phost->pActiveClass->pData;
+    measureReportTiming(phost, hidHandle);
+    const uint32_t*const report=(const uint32_t*)hidHandle->pData;
+    USBH_UsrLog("Keyboard report: 0x%08lx%08lx", report[1], report[0]);
+    ++pipelineStats.hidReports;
+
+    processReport(reportLayout, hidHandle->pData, hidHandle->DataLength);
+    flushPendingEvents();
+}
+
 void HID_Keybd_UserProcess(USBH_HandleTypeDef *phost)
 {
     if(emuState.ledsUpdated)
@@ -188,64 +410,13 @@ void HID_Keybd_UserProcess(USBH_HandleTypeDef *phost)
         emuState.ledsUpdated=false;
     }
 
-    HID_HandleTypeDef*const hidHandle = (HID_HandleTypeDef*)phost->pActiveClass->pData;
-    USBKeyboardReport report;
-    if(USBH_HID_FifoRead(&hidHandle->fifo, &report, hidHandle->length) ==  hidHandle->length)
+    // A repeat may have been queued just before its key was released
+    uint8_t key;
+    while(Typematic_PopRepeat(&key))
     {
-        USBH_UsrLog("Keyboard report: 0x%08lx%08lx", ((uint32_t*)&report)[1], *(uint32_t*)&report);
-
-        uint8_t currentPressedKeys[KEY_BUF_SIZE]={0};
-        memcpy(&currentPressedKeys, report.keys, sizeof report.keys);
-        if(report.lctrl)
-            addPressedKey(currentPressedKeys, KEY_LEFTCONTROL);
-        if(report.lshift)
-            addPressedKey(currentPressedKeys, KEY_LEFTSHIFT);
-        if(report.lalt)
-            addPressedKey(currentPressedKeys, KEY_LEFTALT);
-        if(report.lgui)
-            addPressedKey(currentPressedKeys, KEY_LEFT_GUI);
-        if(report.rctrl)
-            addPressedKey(currentPressedKeys, KEY_RIGHTCONTROL);
-        if(report.rshift)
-            addPressedKey(currentPressedKeys, KEY_RIGHTSHIFT);
-        if(report.ralt)
-            addPressedKey(currentPressedKeys, KEY_RIGHTALT);
-        if(report.rgui)
-            addPressedKey(currentPressedKeys, KEY_RIGHT_GUI);
-
-        for(unsigned n=0; n<KEY_BUF_SIZE; ++n)
-        {
-            const uint8_t currentKey=currentPressedKeys[n];
-            if(!memchr(pressedKeysUSB, currentKey, KEY_BUF_SIZE))
-                keyPressed(currentKey);
-        }
-
-        for(unsigned n=0; n<KEY_BUF_SIZE; ++n)
-        {
-            const uint8_t oldKey=pressedKeysUSB[n];
-            if(!memchr(currentPressedKeys, oldKey, KEY_BUF_SIZE))
-                keyReleased(oldKey);
-        }
-        memcpy(pressedKeysUSB, currentPressedKeys, KEY_BUF_SIZE);
+        if(pressedKeysUSB.words[key/32] & 1ul<<(key%32))
+            keyRepeated(key);
     }
 
-    switch(typematicMode)
-    {
-    case TM_IDLE:
-        break;
-    case TM_DELAY:
-        if(autorepeatTickCounter > autorepeatDelayInTicks)
-        {
-            typematicMode=TM_REPEAT;
-            autorepeatTickCounter=0;
-        }
-        break;
-    case TM_REPEAT:
-        if(lastPressedKey && autorepeatTickCounter > autorepeatPeriodInTicks)
-        {
-            autorepeatTickCounter=0;
-            keyRepeated(lastPressedKey);
-        }
-        break;
-    }
+    flushPendingEvents();
 }
@@ -0,0 +1,302 @@
+#include <string.h>
+#include "usbh_hid.h"
+#include "hid-report-layout.h"
+#include "scancodes2.h"
+
+const HIDReportLayout hidBootKeyboardLayout =
+{
+    .fields =
+    {
+        // Modifiers
+        {.bitOffset=0, .count=8, .bitSize=1, .usagePage=HID_USAGE_PAGE_KEYBOARD, .usageMin=0xE0, .usageMax=0xE7},
+        // Keys. The boot descriptor declares the range 0..101, but devices send more than that, so accept any byte.
+        {.bitOffset=16, .count=6, .bitSize=8, .isArray=true, .usagePage=HID_USAGE_PAGE_KEYBOARD,
+         .usageMin=0, .usageMax=0xFF, .logicalMin=0},
+    },
+    .numFields=2,
+};
+
+#define MAX_USAGE_RANGES 32
+#define MAX_GLOBAL_STACK_DEPTH 4
+#define MAX_REPORT_IDS 8
+
+typedef struct
+{
+    uint16_t usagePage;
+    int32_t logicalMin;
+    int32_t logicalMax;
+    uint32_t reportSize;
+    uint32_t reportCount;
+    uint8_t reportID;
+} GlobalItems;
+
+typedef struct
+{
+    uint16_t page; // From the high half of an extended (4-byte) usage, 0 to use the Usage Page global item
+    uint16_t min;
+    uint16_t max;
+} UsageRange;
+
+typedef struct
+{
+    UsageRange usages[MAX_USAGE_RANGES];
+    unsigned numUsages;
+    uint32_t usageMin; // Waiting for the matching Usage Maximum
+    bool haveUsageMin;
+} LocalItems;
+
+typedef struct
+{
+    HIDReportLayout* layout;
+    bool withKeyboardPage;
+    GlobalItems global;
+    LocalItems local;
+    // Input reports are laid out independently for each report ID
+    uint8_t reportIDs[MAX_REPORT_IDS];
+    uint32_t inputBitOffsets[MAX_REPORT_IDS];
+    unsigned numReportIDs;
+} Compiler;
+
+static uint32_t itemData(const uint8_t* data, const unsigned size)
+{
+    uint32_t value=0;
+    for(unsigned n=0; n<size; ++n)
+        value |= (uint32_t)data[n] << 8*n;
+    return value;
+}
+
+static int32_t signedItemData(const uint8_t* data, const unsigned size)
+{
+    const uint32_t value=itemData(data, size);
+    if(size==0 || size==4) return value;
+    const uint32_t signBit=1ul<<(8*size-1);
+    return (int32_t)((value^signBit)-signBit);
+}
+
+static void addUsageRange(LocalItems* local, const uint32_t min, const uint32_t max)
+{
+    // The elements beyond the last usage recorded are ignored, as if they had no usages
+    if(local->numUsages==MAX_USAGE_RANGES)
+        return;
+    UsageRange*const range=&local->usages[local->numUsages++];
+    range->page=min>>16;
+    range->min=min;
+    range->max=max;
+}
+
+static uint32_t* inputBitOffset(Compiler* c)
+{
+    for(unsigned n=0; n<c->numReportIDs; ++n)
+        if(c->reportIDs[n]==c->global.reportID)
+            return &c->inputBitOffsets[n];
+    if(c->numReportIDs==MAX_REPORT_IDS)
+        return NULL;
+    c->reportIDs[c->numReportIDs]=c->global.reportID;
+    c->inputBitOffsets[c->numReportIDs]=0;
+    return &c->inputBitOffsets[c->numReportIDs++];
+}
+
+static bool addField(Compiler* c, const HIDReportField* field)
+{
+    if(field->usagePage==HID_USAGE_PAGE_KEYBOARD ? !c->withKeyboardPage :
+       !hidUsageRangeHasKeys(field->usagePage, field->usageMin, field->usageMax))
+        return true;
+    HIDReportLayout*const layout=c->layout;
+    // Consecutive usages listed one by one end up in a single field
+    if(layout->numFields)
+    {
+        HIDReportField*const prev=&layout->fields[layout->numFields-1];
+        if(!prev->isArray && !field->isArray && prev->reportID==field->reportID &&
+           prev->usagePage==field->usagePage && prev->bitSize==field->bitSize &&
+           prev->bitOffset+prev->count*prev->bitSize==field->bitOffset && prev->usageMax+1==field->usageMin)
+        {
+            prev->count+=field->count;
+            prev->usageMax=field->usageMax;
+            return true;
+        }
+    }
+    if(layout->numFields==HID_REPORT_LAYOUT_MAX_FIELDS)
+        return false;
+    layout->fields[layout->numFields++]=*field;
+    return true;
+}
+
+static bool compileInput(Compiler* c, const uint32_t flags)
+{
+    enum
+    {
+        INPUT_CONSTANT=1<<0,
+        INPUT_VARIABLE=1<<1,
+    };
+
+    uint32_t*const offset=inputBitOffset(c);
+    if(!offset) return false;
+    const GlobalItems*const g=&c->global;
+    const LocalItems*const local=&c->local;
+    const uint32_t startOffset=*offset;
+    *offset += g->reportSize*g->reportCount;
+    if(*offset > UINT16_MAX)
+        return false;
+    if((flags & INPUT_CONSTANT) || !local->numUsages || !g->reportSize || g->reportSize>32)
+        return true; // Padding, or nothing we could use
+
+    HIDReportField field =
+    {
+        .bitSize=g->reportSize,
+        .reportID=g->reportID,
+        .logicalMin=g->logicalMin,
+    };
+    if(!(flags & INPUT_VARIABLE))
+    {
+        // The indices map to the usages in order; keyboards list them as a single range
+        field.bitOffset=startOffset;
+        field.count=g->reportCount;
+        field.isArray=true;
+        field.usagePage = local->usages[0].page ? local->usages[0].page : g->usagePage;
+        field.usageMin=local->usages[0].min;
+        field.usageMax=local->usages[local->numUsages-1].max;
+        if(g->logicalMax < g->logicalMin) return true;
+        if((uint32_t)(g->logicalMax-g->logicalMin) < (uint32_t)(field.usageMax-field.usageMin))
+            field.usageMax=field.usageMin+(g->logicalMax-g->logicalMin);
+        return addField(c, &field);
+    }
+
+    // A variable item gets its usages one per element, so it becomes a field per usage range
+    uint32_t element=0;
+    for(unsigned n=0; n<local->numUsages && element<g->reportCount; ++n)
+    {
+        const UsageRange*const range=&local->usages[n];
+        if(range->max < range->min) continue;
+        uint32_t count=range->max-range->min+1;
+        if(count > g->reportCount-element)
+            count=g->reportCount-element;
+        field.bitOffset=startOffset+element*g->reportSize;
+        field.count=count;
+        field.usagePage = range->page ? range->page : g->usagePage;
+        field.usageMin=range->min;
+        field.usageMax=range->min+count-1;
+        if(!addField(c, &field))
+            return false;
+        element+=count;
+    }
+    // If there are more elements than usages, the rest repeat the last usage, which is of no use to us
+    return true;
+}
+
+bool HIDReportLayout_Compile(HIDReportLayout*const layout, const uint8_t* desc, const unsigned length,
+                             const bool withKeyboardPage)
+{
+    enum
+    {
+        ITEM_SIZE_MASK=3,
+        ITEM_LONG_DATA_SIZE=1, // Offset of the data size byte in a long item
+    };
+
+    Compiler c={.layout=layout, .withKeyboardPage=withKeyboardPage};
+    GlobalItems globalStack[MAX_GLOBAL_STACK_DEPTH];
+    unsigned globalStackDepth=0;
+    memset(layout, 0, sizeof *layout);
+
+    for(const uint8_t*const end=desc+length; desc<end;)
+    {
+        const uint8_t prefix=*desc;
+        if(prefix==HID_ITEM_LONG)
+        {
+            // No long items are defined, skip it
+            if(end-desc < 3 || end-desc < 3+desc[ITEM_LONG_DATA_SIZE]) return false;
+            desc += 3+desc[ITEM_LONG_DATA_SIZE];
+            continue;
+        }
+        const unsigned size = (prefix&ITEM_SIZE_MASK)==3 ? 4 : prefix&ITEM_SIZE_MASK;
+        const unsigned type=(prefix>>2)&3;
+        const unsigned tag=prefix>>4;
+        if(end-desc < 1+(int)size) return false;
+        const uint8_t*const data=desc+1;
+        desc += 1+size;
+        const uint32_t value=itemData(data, size);
+
+        switch(type)
+        {
+        case HID_ITEM_TYPE_MAIN:
+            switch(tag)
+            {
+            case HID_MAIN_ITEM_TAG_INPUT:
+                if(!compileInput(&c, value))
+                    return false;
+                break;
+            case HID_MAIN_ITEM_TAG_OUTPUT:
+                if(c.global.usagePage==HID_USAGE_PAGE_LEDS)
+                    layout->ledReportID=c.global.reportID;
+                break;
+            }
+            memset(&c.local, 0, sizeof c.local);
+            break;
+        case HID_ITEM_TYPE_GLOBAL:
+            switch(tag)
+            {
+            case HID_GLOBAL_ITEM_TAG_USAGE_PAGE:   c.global.usagePage=value;   break;
+            case HID_GLOBAL_ITEM_TAG_REPORT_SIZE:  c.global.reportSize=value;  break;
+            case HID_GLOBAL_ITEM_TAG_REPORT_COUNT: c.global.reportCount=value; break;
+            case HID_GLOBAL_ITEM_TAG_LOG_MIN:
+                c.global.logicalMin=signedItemData(data, size);
+                break;
+            case HID_GLOBAL_ITEM_TAG_LOG_MAX:
+                // Many descriptors encode e.g. 255 as a single byte, so it's unsigned unless the minimum is negative
+                c.global.logicalMax = c.global.logicalMin>=0 ? (int32_t)value : signedItemData(data, size);
+                break;
+            case HID_GLOBAL_ITEM_TAG_REPORT_ID:
+                if(!value || value>0xFF) return false;
+                c.global.reportID=value;
+                layout->usesReportIDs=true;
+                break;
+            case HID_GLOBAL_ITEM_TAG_PUSH:
+                if(globalStackDepth==MAX_GLOBAL_STACK_DEPTH) return false;
+                globalStack[globalStackDepth++]=c.global;
+                break;
+            case HID_GLOBAL_ITEM_TAG_POP:
+                if(!globalStackDepth) return false;
+                c.global=globalStack[--globalStackDepth];
+                break;
+            }
+            break;
+        case HID_ITEM_TYPE_LOCAL:
+            switch(tag)
+            {
+            case HID_LOCAL_ITEM_TAG_USAGE:
+                addUsageRange(&c.local, value, value);
+                break;
+            case HID_LOCAL_ITEM_TAG_USAGE_MIN:
+                c.local.usageMin=value;
+                c.local.haveUsageMin=true;
+                break;
+            case HID_LOCAL_ITEM_TAG_USAGE_MAX:
+                if(!c.local.haveUsageMin) return false;
+                addUsageRange(&c.local, c.local.usageMin, value);
+                c.local.haveUsageMin=false;
+                break;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return layout->numFields!=0;
+}
+
+uint32_t HIDReportLayout_ReadElement(const HIDReportField*const field, const uint8_t*const payload, const unsigned n)
+{
+    const unsigned bitPos=field->bitOffset+n*field->bitSize;
+    if(field->bitSize==8 && bitPos%8==0)
+        return payload[bitPos/8];
+
+    const uint8_t*const bytes=payload+bitPos/8;
+    const unsigned shift=bitPos%8;
+    const unsigned numBytes=(shift+field->bitSize+7)/8;
+    uint64_t bits=0;
+    for(unsigned i=0; i<numBytes; ++i)
+        bits |= (uint64_t)bytes[i] << 8*i;
+    bits >>= shift;
+    if(field->bitSize<32)
+        bits &= ((uint64_t)1<<field->bitSize)-1;
+    return bits;
+}
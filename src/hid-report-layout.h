@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define HID_USAGE_PAGE_GENERIC_DESKTOP 0x01
+#define HID_USAGE_PAGE_KEYBOARD        0x07
+#define HID_USAGE_PAGE_LEDS            0x08
+#define HID_USAGE_PAGE_CONSUMER        0x0C
+
+#define HID_REPORT_LAYOUT_MAX_FIELDS 32
+
+// An Input item of the report descriptor, reduced to what's needed to read it from a report
+typedef struct
+{
+    uint16_t bitOffset; // From the start of the report, not counting the report ID byte
+    uint16_t count;
+    uint8_t bitSize;    // Of one element, 1..32
+    uint8_t reportID;   // 0 if the device doesn't use report IDs
+    bool isArray;
+    uint16_t usagePage;
+    // Variable items: element n reports usage usageMin+n. Arrays: each element holds an index, and
+    // index logicalMin corresponds to usageMin.
+    uint16_t usageMin;
+    uint16_t usageMax;
+    int32_t logicalMin;
+} HIDReportField;
+
+// The result of compiling a report descriptor: a flat list of the fields we can use. Decoding a report
+// is then a single pass over the fields with the report's ID, without interpreting the descriptor again.
+typedef struct
+{
+    HIDReportField fields[HID_REPORT_LAYOUT_MAX_FIELDS];
+    uint8_t numFields;
+    bool usesReportIDs;
+    uint8_t ledReportID; // ID of the Output report with the keyboard LEDs
+} HIDReportLayout;
+
+// Layout of the boot protocol keyboard report
+extern const HIDReportLayout hidBootKeyboardLayout;
+
+// Keeps the Input fields of usages that have scan codes: on keyboard page if withKeyboardPage is set, and
+// the Consumer and System Control ones (see hidUsageToKey()). Returns false if the descriptor is malformed
+// or has no such fields, in which case the layout must not be used.
+bool HIDReportLayout_Compile(HIDReportLayout* layout, const uint8_t* desc, unsigned length, bool withKeyboardPage);
+
+// Reads element n of the field from the report payload, i.e. after the report ID byte if there's one
+uint32_t HIDReportLayout_ReadElement(const HIDReportField* field, const uint8_t* payload, unsigned n);
+
+#ifdef __cplusplus
+}
+#endif
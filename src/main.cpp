@@ -6,6 +6,7 @@
 #include "led.h"
 #include "hid-keybd.h"
 #include "ps2-kbd-emulator.h"
+#include "typematic.h"
 
 enum class State : uint8_t
 {
@@ -28,6 +29,7 @@ void USBH_UserProcess(USBH_HandleTypeDef* phost, uint8_t event)
     case HOST_USER_DISCONNECTION:
         usbState = State::Idle;
         processingState = State::Idle;
+        Typematic_StopAll();
         USBH_UsrLog("USB device disconnected");
         ledsOff();
         break;
@@ -105,6 +107,7 @@ int main(void)
         abort();
 
     PS2_Init();
+    Typematic_Init();
 
     USBH_HandleTypeDef hUSBHost;
     USBH_Init(&hUSBHost, USBH_UserProcess, 0);
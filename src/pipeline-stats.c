@@ -0,0 +1,96 @@
+#include <string.h>
+#include "usbh_conf.h"
+#include "pipeline-stats.h"
+
+volatile PipelineStats pipelineStats;
+
+static void copyStats(PipelineStats* dest)
+{
+    // All the fields are words, and each word is read atomically
+    const volatile uint32_t* src=(const volatile uint32_t*)&pipelineStats;
+    uint32_t* dst=(uint32_t*)dest;
+    for(unsigned n=0; n<sizeof(PipelineStats)/sizeof(uint32_t); ++n)
+        dst[n]=src[n];
+}
+
+void PipelineStats_Snapshot(PipelineStats* snapshot)
+{
+    // Counters only grow, so if nothing has changed between the two copies, the first one is consistent
+    PipelineStats check;
+    copyStats(snapshot);
+    for(;;)
+    {
+        copyStats(&check);
+        if(!memcmp(snapshot, &check, sizeof check))
+            return;
+        memcpy(snapshot, &check, sizeof check);
+    }
+}
+
+void PipelineStats_CountHostCommand(const uint8_t cmd)
+{
+    if(cmd>=PIPELINE_STATS_FIRST_HOST_CMD)
+        ++pipelineStats.hostCommands[cmd-PIPELINE_STATS_FIRST_HOST_CMD];
+    else
+        ++pipelineStats.unknownHostCommands;
+}
+
+void PipelineStats_CountReportDelay(const uint32_t delayUs)
+{
+    const uint32_t bucket=delayUs/PIPELINE_STATS_REPORT_DELAY_BUCKET_US;
+    ++pipelineStats.reportDelayHistogram[bucket<PIPELINE_STATS_NUM_REPORT_DELAY_BUCKETS ? bucket :
+                                                                                       PIPELINE_STATS_NUM_REPORT_DELAY_BUCKETS-1];
+    pipelineStats.reportDelaySumUs+=delayUs;
+    if(delayUs>pipelineStats.reportDelayMaxUs)
+        pipelineStats.reportDelayMaxUs=delayUs;
+}
+
+void PipelineStats_CountReportInterval(const uint32_t frames, const uint32_t pollFrames)
+{
+    ++pipelineStats.reportIntervalHistogram[frames<PIPELINE_STATS_NUM_REPORT_INTERVAL_BUCKETS ? frames :
+                                                                                             PIPELINE_STATS_NUM_REPORT_INTERVAL_BUCKETS-1];
+    if(frames<pollFrames)
+        ++pipelineStats.reportIntervalsShorter;
+    else if(frames==pollFrames)
+        ++pipelineStats.reportIntervalsEqual;
+    else
+        ++pipelineStats.reportIntervalsLonger;
+}
+
+void PipelineStats_Report(void)
+{
+    PipelineStats s;
+    PipelineStats_Snapshot(&s);
+    USBH_UsrLog("USB: %lu reports, %lu key events, %lu discarded", s.hidReports, s.keyEvents, s.keyEventsDiscarded);
+    uint32_t delayedReports=0;
+    for(unsigned n=0; n<PIPELINE_STATS_NUM_REPORT_DELAY_BUCKETS; ++n)
+        delayedReports+=s.reportDelayHistogram[n];
+    USBH_UsrLog("Report delay: mean %lu us, max %lu us, %lu unknown",
+                delayedReports ? s.reportDelaySumUs/delayedReports : 0ul, s.reportDelayMaxUs, s.reportDelaysUnknown);
+    for(unsigned n=0; n<PIPELINE_STATS_NUM_REPORT_DELAY_BUCKETS; ++n)
+    {
+        if(s.reportDelayHistogram[n])
+            USBH_UsrLog("  from %u us: %lu", n*PIPELINE_STATS_REPORT_DELAY_BUCKET_US, s.reportDelayHistogram[n]);
+    }
+    USBH_UsrLog("Report interval vs poll interval: %lu shorter, %lu equal, %lu longer",
+                s.reportIntervalsShorter, s.reportIntervalsEqual, s.reportIntervalsLonger);
+    for(unsigned n=0; n<PIPELINE_STATS_NUM_REPORT_INTERVAL_BUCKETS; ++n)
+    {
+        if(s.reportIntervalHistogram[n])
+            USBH_UsrLog("  %u frames%s: %lu", n, n==PIPELINE_STATS_NUM_REPORT_INTERVAL_BUCKETS-1 ? " or more" : "",
+                        s.reportIntervalHistogram[n]);
+    }
+    USBH_UsrLog("Output: buffer high water %lu, %lu scan code bytes queued, %lu restarts",
+                s.keyboardBufferHighWater, s.scanCodeBytesQueued, s.interruptedRestarts);
+    USBH_UsrLog("Overflow: %lu repeats collapsed, %lu pairs cancelled, %lu makes dropped, %lu breaks deferred",
+                s.repeatsCollapsed, s.pairsCancelled, s.makesDropped, s.breaksDeferred);
+    USBH_UsrLog("Typematic: %lu repeats not picked up in time", s.repeatsNotPickedUp);
+    USBH_UsrLog("Host: %lu failed receptions, %lu resend replies, %lu unknown commands",
+                s.failedReceptions, s.resendReplies, s.unknownHostCommands);
+    USBH_UsrLog("Replies: max latency %lu us, %lu late", s.replyLatencyMaxUs, s.repliesLate);
+    for(unsigned n=0; n<PIPELINE_STATS_NUM_HOST_CMDS; ++n)
+    {
+        if(s.hostCommands[n])
+            USBH_UsrLog("  command %02X: %lu", n+PIPELINE_STATS_FIRST_HOST_CMD, s.hostCommands[n]);
+    }
+}
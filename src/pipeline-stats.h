@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Host commands are 0xED..0xFF
+#define PIPELINE_STATS_FIRST_HOST_CMD 0xED
+#define PIPELINE_STATS_NUM_HOST_CMDS (0x100-PIPELINE_STATS_FIRST_HOST_CMD)
+#define PIPELINE_STATS_REPORT_DELAY_BUCKET_US 250
+#define PIPELINE_STATS_NUM_REPORT_DELAY_BUCKETS 24
+#define PIPELINE_STATS_NUM_REPORT_INTERVAL_BUCKETS 16
+
+// Counters of the USB-to-PS/2 conversion path. They only ever grow, and are updated from both the main loop
+// and interrupt handlers, each counter by only one of them. Use PipelineStats_Snapshot() to read them
+// consistently, or just print pipelineStats from the debugger.
+typedef struct
+{
+    // USB side
+    uint32_t hidReports;
+    uint32_t keyEvents;
+    uint32_t keyEventsDiscarded; // Generated while the keyboard was disabled by the host or was being reset
+    // Delay of keyboard reports from the start of the frame in which their IN transfer completed to their
+    // decoding
+    uint32_t reportDelayMaxUs;
+    uint32_t reportDelaySumUs;  // Divide by the total of reportDelayHistogram for the mean
+    uint32_t reportDelayHistogram[PIPELINE_STATS_NUM_REPORT_DELAY_BUCKETS]; // The last bucket also counts longer delays
+    uint32_t reportDelaysUnknown; // Reports decoded too late for the start of their frame to be still known
+    // Spacing of successive keyboard reports, in frames between the completions of their IN transfers. It's
+    // compared to the poll interval, which is the expected spacing while the keyboard has something to report;
+    // longer spacings also come from the keyboard having nothing new to report.
+    uint32_t reportIntervalHistogram[PIPELINE_STATS_NUM_REPORT_INTERVAL_BUCKETS]; // The last bucket also counts longer intervals
+    uint32_t reportIntervalsShorter; // Than the poll interval
+    uint32_t reportIntervalsEqual;
+    uint32_t reportIntervalsLonger;
+    // Key output
+    uint32_t keyboardBufferHighWater; // Maximum number of events that were waiting in keyboardBuffer
+    uint32_t scanCodeBytesQueued;     // Passed to the bus driver, including retransmissions
+    uint32_t interruptedRestarts;     // Scan codes that had to be retransmitted from the start
+    // Overflow handling of keyboardBuffer, see pushKeyEventWithoutLoss()
+    uint32_t repeatsCollapsed;   // Typematic makes dropped, since the host can't tell their number anyway
+    uint32_t pairsCancelled;     // Make/break pairs of the same key removed before being sent
+    uint32_t makesDropped;       // Makes dropped along with the subsequent repeats and break of the key
+    uint32_t breaksDeferred;     // Breaks that didn't fit and were stored in pendingBreaks
+    uint32_t repeatsNotPickedUp; // Typematic repeats dropped because the main loop hadn't taken the previous ones
+    // Host side
+    uint32_t failedReceptions;   // Bytes from the host with wrong start, parity or stop bit
+    uint32_t resendReplies;
+    uint32_t replyLatencyMaxUs;  // From the end of a byte from the host to the start of our reply to it
+    uint32_t repliesLate;        // Replies that started later than REPLY_LATENCY_LIMIT_US after the host byte
+    uint32_t hostCommands[PIPELINE_STATS_NUM_HOST_CMDS]; // Indexed by command-PIPELINE_STATS_FIRST_HOST_CMD
+    uint32_t unknownHostCommands;
+} PipelineStats;
+
+extern volatile PipelineStats pipelineStats;
+
+// Copies the counters without masking interrupts, retrying until two successive copies match
+void PipelineStats_Snapshot(PipelineStats* snapshot);
+void PipelineStats_CountHostCommand(uint8_t cmd);
+void PipelineStats_CountReportDelay(uint32_t delayUs);
+void PipelineStats_CountReportInterval(uint32_t frames, uint32_t pollFrames);
+void PipelineStats_Report(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,18 +1,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "RingBuffer.hpp"
+#include "SPSCQueue.hpp"
 #include "stm32f4xx_hal.h"
 #include "stm32f4xx_hal_conf.h"
 #include "stm32f4xx_hal_tim.h"
 #include "ps2-kbd-emulator.h"
 #include "hid-keybd.h"
+#include "scancodes2.h"
+#include "pipeline-stats.h"
+#include "typematic.h"
 #include "util.h"
 
 // Reference used: https://www.avrfreaks.net/sites/default/files/PS2%20Keyboard.pdf
 
 // HW-configuration-dependent and protocol-constrained values
-constexpr uint32_t QUADRUPLE_CLK_RATE=4*12500u; // Frequency must be 10..16.7 kHz (i.e. full period 60..100 us).
+// Frequency must be 10..16.7 kHz (i.e. full period 60..100 us). It can be changed at runtime by BusDriver::setClockRate().
+constexpr uint32_t MIN_CLK_RATE=10000;
+constexpr uint32_t MAX_CLK_RATE=16700;
+constexpr uint32_t DEFAULT_CLK_RATE=12500;
 constexpr uint32_t DELAY_MS_BEFORE_SENDING_BAT_CODE=550; // Must be 500..750
+constexpr uint32_t REPLY_LATENCY_LIMIT_US=20000; // The host may give up waiting for a reply to its command after this
+constexpr uint32_t COMMAND_ARGUMENT_TIMEOUT_MS=50; // Scan codes are held back until the argument comes, at most this long
+constexpr uint32_t AUTOREPEAT_TICK_RATE=TYPEMATIC_TICK_RATE; // Typematic timing is done by TIM5, see typematic.cpp
+constexpr uint32_t ISR_PROFILE_REPORT_PERIOD_MS=10000; // Only used if ENABLE_ISR_PROFILING is defined
+constexpr uint32_t PIPELINE_STATS_REPORT_PERIOD_MS=10000; // Only used if ENABLE_DEBUG_OUTPUT is defined
 
 #define DATA_GPIO_LETTER E
 #define DATA_PIN_NUM 6
@@ -26,6 +38,25 @@ constexpr uint32_t DELAY_MS_BEFORE_SENDING_BAT_CODE=550; // Must be 500..750
 #define CLK_PIN CLK_GPIO,CLK_PIN_NUM
 #define CLK_PIN_ENABLE() CONCAT(__HAL_RCC_GPIO,CLK_GPIO_LETTER,_CLK_ENABLE())
 
+// While the bus is idle, we wait for edges on CLK and DATA instead of polling them with the timer.
+// EXTI lines 5..9 and 10..15 share interrupt vectors, so these must be updated when the pins are changed.
+#define DATA_EXTI_IRQn EXTI9_5_IRQn
+#define DATA_EXTI_IRQHandler EXTI9_5_IRQHandler
+#define CLK_EXTI_IRQn EXTI15_10_IRQn
+#define CLK_EXTI_IRQHandler EXTI15_10_IRQHandler
+
+constexpr IRQn_Type extiIRQn(const unsigned pin)
+{
+    return pin<5   ? IRQn_Type(EXTI0_IRQn+pin) :
+           pin<10  ? EXTI9_5_IRQn :
+                     EXTI15_10_IRQn;
+}
+static_assert(extiIRQn( CLK_PIN_NUM)== CLK_EXTI_IRQn, "CLK_EXTI_* must match CLK_PIN_NUM");
+static_assert(extiIRQn(DATA_PIN_NUM)==DATA_EXTI_IRQn, "DATA_EXTI_* must match DATA_PIN_NUM");
+static_assert(CLK_EXTI_IRQn!=DATA_EXTI_IRQn, "CLK and DATA must use different EXTI interrupt vectors");
+static_assert(CLK_PIN_NUM!=DATA_PIN_NUM, "CLK and DATA must use different EXTI lines");
+constexpr uint32_t BUS_EXTI_LINES=1u<<CLK_PIN_NUM | 1u<<DATA_PIN_NUM;
+
 enum HostCommand
 {
     CMD_RESET=0xFF,
@@ -58,63 +89,61 @@ enum Reply
 
 static constexpr uint32_t repeatRatePeriodsInTicks[]=
 {
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 30.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 26.7),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 24.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 21.8),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 20.7),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 18.5),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 17.1),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 16.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 15.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 13.3),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 12.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 10.9),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE / 10.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  9.2),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  8.6),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  8.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  7.5),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  6.7),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  6.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  5.5),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  5.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  4.6),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  4.3),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  4.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  3.7),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  3.3),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  3.0),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  2.7),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  2.5),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  2.3),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  2.1),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE /  2.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 30.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 26.7),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 24.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 21.8),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 20.7),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 18.5),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 17.1),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 16.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 15.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 13.3),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 12.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 10.9),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE / 10.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  9.2),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  8.6),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  8.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  7.5),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  6.7),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  6.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  5.5),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  5.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  4.6),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  4.3),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  4.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  3.7),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  3.3),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  3.0),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  2.7),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  2.5),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  2.3),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  2.1),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE /  2.0),
 };
 static_assert(sizeof repeatRatePeriodsInTicks / sizeof repeatRatePeriodsInTicks[0]==0x20);
 
 static constexpr uint32_t repeatDelaysInTicks[]=
 {
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE * 0.25),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE * 0.50),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE * 0.75),
-    uint32_t(0.5 + QUADRUPLE_CLK_RATE * 1.00),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE * 0.25),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE * 0.50),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE * 0.75),
+    uint32_t(0.5 + AUTOREPEAT_TICK_RATE * 1.00),
 };
 static_assert(sizeof repeatDelaysInTicks / sizeof repeatDelaysInTicks[0]==4);
 
-volatile uint32_t autorepeatTickCounter=0;
-uint32_t autorepeatPeriodInTicks=repeatRatePeriodsInTicks[0x0B];
-uint32_t autorepeatDelayInTicks =repeatDelaysInTicks[1];
+volatile uint32_t autorepeatPeriodInTicks=repeatRatePeriodsInTicks[0x0B];
+volatile uint32_t autorepeatDelayInTicks =repeatDelaysInTicks[1];
 volatile bool kbdEnabled=true;
 volatile bool kbdBusy=true; // Busy by default until we enter main loop
-uint8_t lastSentByte=0xAA;
 
-static void inMode(GPIO_TypeDef* gpio, const uint16_t pin)
-{
-    gpio->MODER &= ~(GPIO_MODER_MODER0<<2*pin); // clear the mode, this means input
-}
-static void outMode(GPIO_TypeDef* gpio, const uint16_t pin)
+// The pins are open-drain outputs, so a line is released by setting the pin high, and its actual state,
+// which may be driven low by the host, can still be read from IDR.
+static void openDrainOutMode(GPIO_TypeDef* gpio, const uint16_t pin)
 {
+    gpio->BSRR = 1u<<pin; // make sure we don't pull the line low when the output is enabled
+    gpio->OTYPER |= 1u<<pin;
     auto moder=gpio->MODER;
     moder &= ~(GPIO_MODER_MODER0<<2*pin); // clear mode bits
     moder |= GPIO_MODER_MODER0_0<<2*pin; // set GP output mode
@@ -122,17 +151,184 @@ static void outMode(GPIO_TypeDef* gpio, const uint16_t pin)
 }
 static void high(GPIO_TypeDef* gpio, const uint16_t pin)
 {
-    inMode(gpio,pin);
+    gpio->BSRR = 1u<<pin;
 }
 static void low(GPIO_TypeDef* gpio, const uint16_t pin)
 {
-    outMode(gpio,pin);
-    gpio->BSRR = 1u<<(pin+16); // set the pin low
+    gpio->BSRR = 1u<<(pin+16);
 }
 static bool read(GPIO_TypeDef* gpio, const uint16_t pin)
 {
     return gpio->IDR & 1u<<pin;
 }
+static void connectToEXTI(GPIO_TypeDef* gpio, const uint16_t pin)
+{
+    auto& exticr=SYSCFG->EXTICR[pin>>2];
+    exticr = (exticr & ~(0xFu<<4*(pin&3))) | GPIO_GET_INDEX(gpio)<<4*(pin&3);
+}
+
+// Number of TIM3 (and TIM1) clocks in one tick, i.e. a quarter of the PS/2 clock period. Set by BusDriver::setClockRate().
+static uint32_t tickTimerPeriod;
+static bool tickTimerRunning()
+{
+    return TIM3->CR1 & TIM_CR1_CEN;
+}
+static void setTicksToNextTimerISR(const unsigned ticks)
+{
+    // Auto-reload preload is disabled, so this takes effect in the current period. We are only called at
+    // the beginning of a period, so the counter can't have already passed the new value.
+    TIM3->ARR=ticks*tickTimerPeriod-1;
+}
+static void startTickTimer()
+{
+    TIM3->CNT=0;
+    setTicksToNextTimerISR(1);
+    TIM3->CR1 |= TIM_CR1_CEN;
+}
+static void stopTickTimer()
+{
+    TIM3->CR1 &= ~TIM_CR1_CEN;
+}
+
+#ifdef ENABLE_ISR_PROFILING
+// Durations of ISR invocations in CPU cycles, as measured by DWT->CYCCNT
+struct CycleStats
+{
+    uint32_t min=UINT32_MAX;
+    uint32_t max=0;
+    uint64_t total=0;
+    uint32_t count=0;
+
+    void add(const uint32_t cycles) volatile
+    {
+        if(cycles<min) min=cycles;
+        if(cycles>max) max=cycles;
+        total+=cycles;
+        // Must be updated last, see snapshot()
+        ++count;
+    }
+    uint32_t mean() const { return count ? total/count : 0; }
+    // Reads the stats without masking interrupts. If an ISR has updated them while we were reading, count
+    // will have changed, so we just retry.
+    CycleStats snapshot() const volatile
+    {
+        CycleStats s;
+        do
+        {
+            s.count=count;
+            s.min=min;
+            s.max=max;
+            s.total=total;
+        } while(s.count!=count);
+        return s;
+    }
+};
+#endif
+
+// Transmission of a frame is sequenced by TIM1 and DMA2 without CPU intervention (DMA1 can't access the GPIO
+// ports, so TIM3 can't be used for this). TIM1 counts up and down in center-aligned mode, one bit per up-down
+// period, so that each compare channel triggers two transfers per bit, symmetric around its middle:
+//   CH4 at 1/16 and 15/16 of the period: put the current, then the next bit of the frame on DATA,
+//   CH2 at 1/8 and 7/8 of the period: disarm, then arm the EXTI falling edge trigger of CLK,
+//   CH3 at 1/8 and 7/8 of the period: sample CLK to detect the host inhibiting the bus,
+//   CH1 at 1/4 and 3/4 of the period: lower, then raise CLK.
+// The EXTI trigger is only armed while we don't drive CLK low ourselves, so its interrupt means that the host
+// has pulled CLK low, and the frame is aborted at once. The samples catch the host holding CLK low across our
+// own low phase, which makes no edge; they are checked at the end of the frame. So a frame normally costs a
+// single interrupt, at its end. All these requests are served by DMA2 channel 6, each by a stream of its own.
+constexpr uint32_t TX_DMA_CHANNEL=6;
+class DMA2Stream
+{
+    const unsigned num;
+
+    unsigned flagShift() const { return (num&1)*6 + (num&2)*8; }
+public:
+    constexpr DMA2Stream(const unsigned num) : num(num) {}
+
+    DMA_Stream_TypeDef* regs() const { return reinterpret_cast<DMA_Stream_TypeDef*>(DMA2_Stream0_BASE+0x18*num); }
+    uint32_t flags() const { return (num<4 ? DMA2->LISR : DMA2->HISR) >> flagShift(); }
+    void clearFlags() const { (num<4 ? DMA2->LIFCR : DMA2->HIFCR) = 0x3Du<<flagShift(); }
+
+    // cr specifies direction, memory increment and interrupts to enable
+    void start(volatile uint32_t* periph, const volatile uint32_t* mem, const uint16_t count, const uint32_t cr) const
+    {
+        const auto stream=regs();
+        stream->CR=0;
+        clearFlags();
+        stream->PAR =uint32_t(uintptr_t(periph));
+        stream->M0AR=uint32_t(uintptr_t(mem));
+        stream->NDTR=count;
+        stream->FCR=0; // Direct mode
+        stream->CR = cr | TX_DMA_CHANNEL<<DMA_SxCR_CHSEL_Pos | DMA_SxCR_PL | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 | DMA_SxCR_EN;
+    }
+    void stop() const
+    {
+        regs()->CR &= ~DMA_SxCR_EN;
+        while(regs()->CR & DMA_SxCR_EN);
+        clearFlags();
+    }
+};
+constexpr DMA2Stream txClkStream(1);       // TIM1_CH1
+constexpr DMA2Stream txClkTriggerStream(2); // TIM1_CH2
+constexpr DMA2Stream txClkSampleStream(6);  // TIM1_CH3
+constexpr DMA2Stream txDataStream(4);       // TIM1_CH4
+#define TX_CLK_DMA_IRQn        DMA2_Stream1_IRQn
+#define TX_CLK_DMA_IRQHandler  DMA2_Stream1_IRQHandler
+
+constexpr uint32_t CLK_SET_BSRR   =1u<< CLK_PIN_NUM;
+constexpr uint32_t CLK_RESET_BSRR =1u<<(CLK_PIN_NUM+16);
+constexpr uint32_t DATA_SET_BSRR  =1u<< DATA_PIN_NUM;
+constexpr uint32_t DATA_RESET_BSRR=1u<<(DATA_PIN_NUM+16);
+// Source of the DMA writes that toggle CLK, one pair per bit of a frame. Not circular, so that the transfer
+// complete interrupt only comes at the end of the frame.
+#define CLK_PULSE_WRITES CLK_RESET_BSRR, CLK_SET_BSRR
+FASTCONST static const uint32_t clkWrites[]={CLK_PULSE_WRITES, CLK_PULSE_WRITES, CLK_PULSE_WRITES, CLK_PULSE_WRITES,
+                                             CLK_PULSE_WRITES, CLK_PULSE_WRITES, CLK_PULSE_WRITES, CLK_PULSE_WRITES,
+                                             CLK_PULSE_WRITES, CLK_PULSE_WRITES, CLK_PULSE_WRITES};
+#undef CLK_PULSE_WRITES
+constexpr uint32_t CLK_EXTI_LINE=1u<<CLK_PIN_NUM;
+
+// A frame is kept as an 11-bit word in the order the bits appear on the bus: bit 0 is the start bit,
+// bits 1..8 are the data bits (LSB first), bit 9 is the odd parity bit, bit 10 is the stop bit.
+constexpr unsigned FRAME_PARITY_BIT=9;
+constexpr unsigned FRAME_STOP_BIT=10;
+struct ParityTable
+{
+    uint8_t oddParityBits[256];
+};
+static constexpr ParityTable makeParityTable()
+{
+    ParityTable table{};
+    for(unsigned byte=0; byte<256; ++byte)
+    {
+        uint8_t parity=1;
+        for(unsigned b=byte; b; b>>=1)
+            parity ^= b&1;
+        table.oddParityBits[byte]=parity;
+    }
+    return table;
+}
+// Read by the ISR to validate each byte from the host
+FASTCONST static constexpr ParityTable parityTable=makeParityTable();
+static_assert(parityTable.oddParityBits[0x00]==1 && parityTable.oddParityBits[0x01]==0 &&
+              parityTable.oddParityBits[0xFF]==1 && parityTable.oddParityBits[0xAA]==1);
+
+static constexpr uint16_t makeFrame(const uint8_t byte)
+{
+    return byte<<1 | parityTable.oddParityBits[byte]<<FRAME_PARITY_BIT | 1u<<FRAME_STOP_BIT;
+}
+static constexpr bool frameIsValid(const uint16_t frame)
+{
+    const uint8_t byte=frame>>1;
+    return !(frame&1) && (frame>>FRAME_STOP_BIT&1) &&
+           (frame>>FRAME_PARITY_BIT&1)==parityTable.oddParityBits[byte];
+}
+static_assert(frameIsValid(makeFrame(0x00)) && frameIsValid(makeFrame(0xFA)) && !frameIsValid(makeFrame(0xFA)^1u<<3));
+
+// In an unnamed namespace, so that the member functions defined in the class aren't COMDAT: GCC doesn't allow
+// these and the out-of-class RAMFUNCs in one section.
+namespace
+{
 
 class BusDriver
 {
@@ -144,29 +340,65 @@ public:
         InProgress,
         Failed, // Due to parity error when receiving
     };
+    static constexpr unsigned MAX_BURST_LENGTH=8; // The longest scan code is that of Pause
 
 private:
+    uint32_t clockRate_=DEFAULT_CLK_RATE;
     // The bus is free if CLK and DATA are high for at least 50 us
-    static constexpr uint8_t NUM_TICKS_TO_MARK_BUS_AS_FREE=1+50*QUADRUPLE_CLK_RATE/1000'000;
-    volatile enum class State : uint8_t
+    uint8_t numTicksToMarkBusAsFree;
+    // Each state is handled by one TIM3 interrupt. Delays between actions are implemented by changing the timer
+    // period (see stateTable below) rather than by passing through states that do nothing.
+    enum class State : uint8_t
     {
         WaitingForEvents,
-        SendingByte_UpdateDATA,
-        SendingByte_LowerCLK,
-        SendingByte_RaiseCLK,
-        SendingByte_WaitingBeforeRaisingCLK,
+        SendingByte_HardwareSequenced,
+        ReadingHostByte_FirstLowerCLK, // Same as ReadingHostByte_LowerCLK, but entered from WaitingForEvents
         ReadingHostByte_LowerCLK,
         ReadingHostByte_RaiseCLKAndReadDATA,
+        ReadingHostByte_SendingAckBit_LowerDATA,
+        ReadingHostByte_SendingAckBit_LowerCLK,
+        ReadingHostByte_SendingAckBit_RaiseCLK,
+        ReadingHostByte_SendingAckBit_RaiseDATA,
         ReadingHostByte_SendingAckBit_FinalCLKLowering,
         ReadingHostByte_SendingAckBit_FinalCLKRaise,
-        ReadingHostByte_SendingAckBit_LowerCLK,
-        ReadingHostByte_SendingAckBit_LowerDATA,
-        ReadingHostByte_SendingAckBit_RaisingDATA,
-        ReadingHostByte_SendingAckBit_WaitingBeforeFinalCLKRaise,
-        ReadingHostByte_SendingAckBit_WaitingBeforeRaisingCLK,
-        ReadingHostByte_WaitingBeforeLoweringCLK,
-        ReadingHostByte_WaitingBeforeRaisingCLK,
-    } nextState = State::WaitingForEvents;
+
+        NumStates
+    };
+    volatile State nextState = State::WaitingForEvents;
+
+    // Handlers perform the action of their state and return the next state
+    using StateHandler = State (BusDriver::*)();
+    struct StateTableEntry
+    {
+        StateHandler handler;
+        uint8_t ticksBefore; // Number of ticks from entering the state to calling its handler
+    };
+    struct StateTable
+    {
+        StateTableEntry entries[unsigned(State::NumStates)];
+    };
+    struct StateDescription
+    {
+        State state;
+        StateHandler handler;
+        uint8_t ticksBefore;
+    };
+    template<unsigned N>
+    static constexpr StateTable makeStateTable(const StateDescription (&descriptions)[N])
+    {
+        StateTable table{};
+        for(const auto& d : descriptions)
+            table.entries[unsigned(d.state)] = {d.handler, d.ticksBefore};
+        return table;
+    }
+    static constexpr bool isComplete(const StateTable& table)
+    {
+        for(const auto& entry : table.entries)
+            if(!entry.handler || !entry.ticksBefore)
+                return false;
+        return true;
+    }
+    static const StateTable stateTable;
 
     uint8_t numTicksBusFree=0; // Number of consecutive timer periods the bus has been found free
     enum class BusState : uint8_t
@@ -178,342 +410,933 @@ private:
         Freeing,     // Both CLK and DATA are high, but not for sufficiently long yet
     } busState=BusState::Low;
 
-    union
-    {
-        uint8_t byteToSend;
-        uint8_t byteReceived;
-    };
-    union
-    {
-        uint8_t parityToSend;
-        uint8_t parityOfBitsReceived;
-    };
-    volatile bool needToSendByte=false;
-    union
-    {
-        // Number of bits of current byte+start+stop+parity that have already been set on the DATA line
-        uint8_t numBitsSent;
-        uint8_t numBitsReceived;
-    };
+    // Raw frame being read from the host, validated as a whole after the stop bit has been read
+    uint16_t frameReceived;
+    // Number of bits of current byte+start+stop+parity that have already been read from the DATA line
+    uint8_t numBitsReceived;
+
+    static constexpr unsigned NUM_CLK_PULSES_IN_FRAME=11;
+    // Transfers of each stream until the last rising edge of CLK, two per bit, but the ones after that edge
+    static constexpr unsigned NUM_TX_CLK_WRITES=2*NUM_CLK_PULSES_IN_FRAME;
+    static constexpr unsigned NUM_TX_DATA_WRITES=2*NUM_CLK_PULSES_IN_FRAME-1;
+    static constexpr unsigned NUM_TX_CLK_SAMPLES=2*NUM_CLK_PULSES_IN_FRAME-1;
+    // BSRR values that set DATA: the bit of the frame being sent, then the next one, for each bit
+    volatile uint32_t txDataWrites[NUM_TX_DATA_WRITES];
+    // CLK port IDR sampled before each falling edge of CLK and after each rising one
+    volatile uint32_t txClkSamples[NUM_TX_CLK_SAMPLES];
+    // EXTI->FTSR values that disarm and arm the falling edge trigger of CLK
+    volatile uint32_t txClkTriggerWrites[2];
+    // Frames of the bytes passed to sendBytes(). They are sent one after another, each as soon as the bus
+    // becomes free after the previous one, without waiting for the main loop. A frame is popped when its
+    // transmission has ended. Frames are built by sendBytes(), so that the ISR only needs to unpack their bits.
+    SPSCQueue<MAX_BURST_LENGTH, uint16_t> txFrames;
+    volatile uint8_t numBurstBytesSent_=0;
+    volatile bool frameInterrupted_=false;
+    volatile uint8_t lastSentByte_=REPLY_BAT_SUCCESS;
+    // Bytes received from the host and not yet consumed by the main loop
+    SPSCQueue<4> rxBytes;
+
     // Number of times we've lowered CLK line
     volatile TransmissionStatus sendingStatus_   =TransmissionStatus::Complete;
     volatile TransmissionStatus receptionStatus_=TransmissionStatus::Complete;
-    volatile bool byteReceivedAvailable_=false;
+    volatile uint32_t lastReceptionEndCycles_=0; // DWT->CYCCNT when the last byte from the host was read
+    // Whether the burst in txFrames replies to the last byte from the host. Cleared once the reply has started.
+    volatile bool burstIsReply_=false;
+
 
+    // The host only sees the reply when its first frame starts, so this is where it has waited the longest
+    void recordReplyLatency()
+    {
+        burstIsReply_=false;
+        const uint32_t latencyUs=(DWT->CYCCNT-lastReceptionEndCycles_)/(SystemCoreClock/1000'000);
+        if(latencyUs>pipelineStats.replyLatencyMaxUs)
+            pipelineStats.replyLatencyMaxUs=latencyUs;
+        if(latencyUs>REPLY_LATENCY_LIMIT_US)
+            ++pipelineStats.repliesLate;
+    }
 
-    void switchToByteSendState()
+    State switchToByteSendState()
     {
+        if(burstIsReply_)
+            recordReplyLatency();
         sendingStatus_=TransmissionStatus::InProgress;
-        nextState=State::SendingByte_UpdateDATA;
-        numBitsSent=0;
-        parityToSend=1; // Odd parity. If all 8 bits are equal, XORing them with this will result in 1.
+        // The whole frame is clocked out by TIM1 and DMA, we only need to be woken up at its end
+        stopTickTimer();
+
+        // A 1 bit turns DATA_RESET_BSRR into DATA_SET_BSRR
+        static_assert(DATA_RESET_BSRR>>16==DATA_SET_BSRR);
+        const uint32_t frame=txFrames.front();
+        for(unsigned n=0; n<NUM_TX_DATA_WRITES; ++n)
+            txDataWrites[n] = DATA_RESET_BSRR >> 16*(frame>>(n+1)/2 & 1);
+
+        low(DATA_PIN); // Start bit
+
+        // Only our own edges may happen on CLK until it's lowered for the first time, so the trigger can be
+        // armed right away. Rising edges must be ignored, since we make one per bit.
+        EXTI->RTSR &= ~CLK_EXTI_LINE;
+        txClkTriggerWrites[1]=EXTI->FTSR | CLK_EXTI_LINE;
+        txClkTriggerWrites[0]=txClkTriggerWrites[1] & ~CLK_EXTI_LINE;
+        EXTI->FTSR=txClkTriggerWrites[1];
+        EXTI->PR=CLK_EXTI_LINE;
+        EXTI->IMR|=CLK_EXTI_LINE;
+
+        // In center-aligned mode, the counter goes from 0 up to ARR and back down in one bit period
+        const uint32_t halfBitPeriod=2*tickTimerPeriod;
+        TIM1->CR1=0;
+        TIM1->CNT=0;
+        TIM1->ARR=halfBitPeriod;
+        TIM1->CCR4=halfBitPeriod/8;
+        TIM1->CCR2=halfBitPeriod/4;
+        TIM1->CCR3=halfBitPeriod/4;
+        TIM1->CCR1=halfBitPeriod/2;
+        TIM1->SR=0;
+        static_assert(sizeof(clkWrites)/sizeof(clkWrites[0])==NUM_TX_CLK_WRITES);
+        txClkStream       .start(&CLK_GPIO->BSRR, clkWrites, NUM_TX_CLK_WRITES, DMA_SxCR_DIR_0 | DMA_SxCR_MINC | DMA_SxCR_TCIE);
+        txClkTriggerStream.start(&EXTI->FTSR, txClkTriggerWrites, 2, DMA_SxCR_DIR_0 | DMA_SxCR_MINC | DMA_SxCR_CIRC);
+        txClkSampleStream .start(&CLK_GPIO->IDR, txClkSamples, NUM_TX_CLK_SAMPLES, DMA_SxCR_MINC);
+        txDataStream      .start(&DATA_GPIO->BSRR, txDataWrites, NUM_TX_DATA_WRITES, DMA_SxCR_DIR_0 | DMA_SxCR_MINC);
+        TIM1->DIER=TIM_DIER_CC1DE | TIM_DIER_CC2DE | TIM_DIER_CC3DE | TIM_DIER_CC4DE;
+        // Compare flags, and thus DMA requests, are set both when counting up and down
+        TIM1->CR1=TIM_CR1_CMS | TIM_CR1_CEN;
+        return State::SendingByte_HardwareSequenced;
+    }
+
+    // CLK is released when it's sampled, so it can only be low if the host holds it
+    bool hostInhibitedTransmission() const
+    {
+        for(unsigned n=0; n<NUM_TX_CLK_SAMPLES; ++n)
+            if(!(txClkSamples[n] & CLK_SET_BSRR))
+                return true;
+        return false;
+    }
+
+    // Drops the current and the remaining bytes of the burst
+    void abortBurst()
+    {
+        sendingStatus_=TransmissionStatus::Interrupted;
+        // This publishes the status to the main loop
+        txFrames.clear();
+    }
+
+    void finishByteSending(const TransmissionStatus status)
+    {
+        TIM1->CR1=0;
+        TIM1->DIER=0;
+        txClkStream.stop();
+        txClkTriggerStream.stop();
+        txClkSampleStream.stop();
+        txDataStream.stop();
+        high(CLK_PIN);
+        high(DATA_PIN);
+        EXTI->IMR &= ~CLK_EXTI_LINE;
+        EXTI->RTSR |= CLK_EXTI_LINE;
+        EXTI->FTSR |= CLK_EXTI_LINE;
+        EXTI->PR = CLK_EXTI_LINE;
+
+        nextState=State::WaitingForEvents;
+        if(status==TransmissionStatus::Complete)
+        {
+            lastSentByte_=txFrames.front()>>1;
+            ++numBurstBytesSent_;
+            // If there are more bytes in the burst, the next one will be sent once the bus has been free for
+            // the required time.
+            if(txFrames.size()==1)
+                sendingStatus_=status;
+            txFrames.pop();
+        }
+        else
+        {
+            frameInterrupted_=true;
+            abortBurst();
+        }
+        numTicksBusFree=0;
+        startTickTimer();
+    }
+
+    // Stops the timer until an edge on CLK or DATA is detected. Used when the bus is in a stable state that
+    // can only be changed by the host, so that we don't spend CPU time polling it.
+    void sleepUntilBusEdge(const bool clk, const bool data)
+    {
+        stopTickTimer();
+        EXTI->PR = BUS_EXTI_LINES;
+        EXTI->IMR |= BUS_EXTI_LINES;
+        // An edge could have happened between sampling and arming EXTI, in which case it's not latched
+        if(read(CLK_PIN)!=clk || read(DATA_PIN)!=data)
+            wakeUp();
+    }
+
+    void wakeUp()
+    {
+        EXTI->IMR &= ~BUS_EXTI_LINES;
+        EXTI->PR = BUS_EXTI_LINES;
+        if(!tickTimerRunning())
+            startTickTimer();
     }
 
-    void switchToByteReceiveState()
+    State switchToByteReceiveState()
     {
+        // Host wants to talk to us, so the rest of the burst must be retransmitted later, if at all
+        if(!txFrames.empty())
+            abortBurst();
         receptionStatus_=TransmissionStatus::InProgress;
-        nextState=State::ReadingHostByte_LowerCLK;
         numBitsReceived=1; // Start bit is already included in RTS state
-        byteReceived=0;
-        byteReceivedAvailable_=false;
-        parityOfBitsReceived=1; // Odd parity. If all 8 bits are equal, XORing them with this will result in 1.
+        frameReceived=0;   // ...and it's low
+        return State::ReadingHostByte_FirstLowerCLK;
+    }
+
+    RAMFUNC State waitForEvents()
+    {
+        // Make sure we don't hold the bus
+        high(CLK_PIN);
+        high(DATA_PIN);
+        // Check bus state
+        const bool clk =read( CLK_PIN);
+        const bool data=read(DATA_PIN);
+        if(clk && data)
+        {
+            if(numTicksBusFree<numTicksToMarkBusAsFree)
+                ++numTicksBusFree;
+
+            if(numTicksBusFree==numTicksToMarkBusAsFree)
+                busState=BusState::Free;
+            else
+                busState=BusState::Freeing;
+        }
+        else
+        {
+            // Bus has become non-free
+            numTicksBusFree=0;
+            if(!clk && data)
+                busState=BusState::Inhibit;
+            else if(clk && !data)
+                busState=BusState::ReqToSend;
+            else
+                busState=BusState::Low;
+        }
+
+        if(busState==BusState::ReqToSend && !rxBytes.full()) // Only read a new byte if there's room for it
+            return switchToByteReceiveState();
+        if(busState==BusState::Free && !txFrames.empty())
+        {
+            // The host expects a reply to its command before anything else
+            if(!rxBytes.empty())
+                abortBurst();
+            else
+                return switchToByteSendState();
+        }
+        if(busState==BusState::Free || busState==BusState::Inhibit)
+            sleepUntilBusEdge(clk, data);
+        return State::WaitingForEvents;
+    }
+
+    RAMFUNC State sendByteHardwareSequenced()
+    {
+        // TIM3 is stopped while TIM1 and DMA are sending the frame, so we shouldn't get here
+        return State::SendingByte_HardwareSequenced;
+    }
+
+    RAMFUNC State readHostByte_LowerCLK()
+    {
+        if(rxBytes.full()) // The previous bytes haven't been consumed yet.
+            return State::ReadingHostByte_LowerCLK;
+        if(!read(CLK_PIN))
+            return State::WaitingForEvents; // Host aborted the transmission
+        low(CLK_PIN);
+        return State::ReadingHostByte_RaiseCLKAndReadDATA;
+    }
+
+    RAMFUNC State readHostByte_RaiseCLKAndReadDATA()
+    {
+        high(CLK_PIN);
+        const uint16_t bit=!!read(DATA_PIN);
+        frameReceived |= bit<<numBitsReceived;
+        if(numBitsReceived==FRAME_STOP_BIT)
+        {
+            lastReceptionEndCycles_=DWT->CYCCNT;
+            if(frameIsValid(frameReceived))
+            {
+                receptionStatus_=TransmissionStatus::Complete;
+                rxBytes.push(uint8_t(frameReceived>>1));
+            }
+            else
+            {
+                receptionStatus_=TransmissionStatus::Failed;
+                ++pipelineStats.failedReceptions;
+            }
+            return State::ReadingHostByte_SendingAckBit_LowerDATA;
+        }
+        ++numBitsReceived;
+        // Host may abort the transmission while CLK is high, this is checked before lowering it
+        return State::ReadingHostByte_LowerCLK;
+    }
+
+    RAMFUNC State sendAckBit_LowerDATA()
+    {
+        low(DATA_PIN);
+        return State::ReadingHostByte_SendingAckBit_LowerCLK;
+    }
+    RAMFUNC State sendAckBit_LowerCLK()
+    {
+        low(CLK_PIN);
+        return State::ReadingHostByte_SendingAckBit_RaiseCLK;
+    }
+    RAMFUNC State sendAckBit_RaiseCLK()
+    {
+        high(CLK_PIN);
+        return State::ReadingHostByte_SendingAckBit_RaiseDATA;
+    }
+    RAMFUNC State sendAckBit_RaiseDATA()
+    {
+        high(DATA_PIN);
+        return State::ReadingHostByte_SendingAckBit_FinalCLKLowering;
+    }
+    RAMFUNC State sendAckBit_FinalCLKLowering()
+    {
+        low(CLK_PIN);
+        return State::ReadingHostByte_SendingAckBit_FinalCLKRaise;
+    }
+    RAMFUNC State sendAckBit_FinalCLKRaise()
+    {
+        high(CLK_PIN);
+        // FIXME: we aren't clocking in until the host releases the DATA line (when this happens
+        // to be needed, it's an error, but the protocol seems to require this from the device).
+        return State::WaitingForEvents;
     }
 
 public:
     void init()
     {
+        setClockRate(DEFAULT_CLK_RATE);
+
         CLK_PIN_ENABLE();
         DATA_PIN_ENABLE();
         // Disable internal pull-ups, their resistance is too large for our needs.
         // Moreover, they pull to 3.3V, while we need 5V.
         // External 10k resistors should be attached as pull-ups.
-        CLK_GPIO ->PUPDR &= ~(1<< CLK_PIN_NUM);
-        DATA_GPIO->PUPDR &= ~(1<<DATA_PIN_NUM);
+        CLK_GPIO ->PUPDR &= ~(GPIO_PUPDR_PUPD0<<2* CLK_PIN_NUM);
+        DATA_GPIO->PUPDR &= ~(GPIO_PUPDR_PUPD0<<2*DATA_PIN_NUM);
+
+        openDrainOutMode(DATA_PIN);
+        openDrainOutMode(CLK_PIN);
+
+        __HAL_RCC_TIM1_CLK_ENABLE();
+        __HAL_RCC_DMA2_CLK_ENABLE();
+        HAL_NVIC_EnableIRQ(TX_CLK_DMA_IRQn);
+
+        __HAL_RCC_SYSCFG_CLK_ENABLE();
+        connectToEXTI(CLK_PIN);
+        connectToEXTI(DATA_PIN);
+        EXTI->IMR  &= ~BUS_EXTI_LINES;
+        EXTI->EMR  &= ~BUS_EXTI_LINES;
+        EXTI->RTSR |= BUS_EXTI_LINES;
+        EXTI->FTSR |= BUS_EXTI_LINES;
+        EXTI->PR = BUS_EXTI_LINES;
+        HAL_NVIC_EnableIRQ( CLK_EXTI_IRQn);
+        HAL_NVIC_EnableIRQ(DATA_EXTI_IRQn);
+
+        // Used to timestamp bytes from the host, and for ISR profiling
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT=0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+
+    // Takes effect starting from the next tick or frame
+    void setClockRate(uint32_t rate)
+    {
+        if(rate<MIN_CLK_RATE) rate=MIN_CLK_RATE;
+        if(rate>MAX_CLK_RATE) rate=MAX_CLK_RATE;
+        USBH_UsrLog("Setting PS/2 clock rate to %lu Hz", rate);
 
-        inMode(DATA_PIN);
-        inMode(CLK_PIN);
+        // These are single-word stores, and the ISR doesn't rely on them being consistent with each other
+        clockRate_=rate;
+        tickTimerPeriod=SystemCoreClock/(4*rate);
+        numTicksToMarkBusAsFree=1+50*4*rate/1000'000;
     }
+    uint32_t clockRate() const { return clockRate_; }
 
     TransmissionStatus sendingStatus() const { return sendingStatus_; }
     TransmissionStatus receptionStatus() const { return receptionStatus_; }
     uint8_t getByteReceived()
     {
-        if(!byteReceivedAvailable_) return 0;
-        byteReceivedAvailable_=false;
-        return byteReceived;
+        uint8_t byte=0;
+        rxBytes.pop(byte);
+        return byte;
     }
-    bool byteReceivedAvailable() const { return byteReceivedAvailable_; }
+    bool byteReceivedAvailable() const { return !rxBytes.empty(); }
     void clearReceptionStatus() { receptionStatus_=TransmissionStatus::Complete; }
 
-    bool isIdle() const { return nextState==State::WaitingForEvents && !needToSendByte; }
+    bool isIdle() const { return txFrames.empty() && nextState==State::WaitingForEvents; }
+    uint8_t lastSentByte() const { return lastSentByte_; }
+    // Number of bytes of the last burst that have been sent. Valid after the burst has ended, i.e. when
+    // isIdle() is true.
+    uint8_t numBurstBytesSent() const { return numBurstBytesSent_; }
+    // Whether the last burst was interrupted in the middle of a frame, as opposed to being aborted before its
+    // next frame started. Valid after the burst has ended.
+    bool frameInterrupted() const { return frameInterrupted_; }
+
+    void sendByte(const uint8_t byte)
+    {
+        sendBytes(&byte, 1);
+    }
 
-    void sendByte(uint8_t byte)
+    // Sends count bytes back to back. The burst is aborted if the host inhibits the bus or requests to send while
+    // it's in progress, in which case sendingStatus() becomes Interrupted, and numBurstBytesSent() tells how many
+    // bytes have actually been sent.
+    // Returns false if the burst can't be started at all, e.g. because the host has sent a byte that hasn't been
+    // handled yet. Then nothing goes on the wire, and sendingStatus() becomes Interrupted too.
+    // If isReply is set, the time the host has waited for the burst is recorded in pipelineStats when it starts.
+    bool sendBytes(const uint8_t* bytes, const uint8_t count, const bool isReply=false)
     {
-        USBH_UsrLog("sendByte(%02X)", (unsigned)byte);
-        if(nextState!=State::WaitingForEvents || byteReceivedAvailable_)
+        USBH_UsrLog("sendBytes(%u bytes, first: %02X)", (unsigned)count, (unsigned)bytes[0]);
+        if(count==0 || count>MAX_BURST_LENGTH)
         {
             sendingStatus_=TransmissionStatus::Interrupted;
-            return;
+            return false;
         }
+        uint16_t frames[MAX_BURST_LENGTH];
+        for(unsigned n=0; n<count; ++n)
+            frames[n]=makeFrame(bytes[n]);
 
-        __disable_irq();
-        needToSendByte=true;
-        byteToSend=byte;
-        __enable_irq();
+        // The ISR doesn't touch the burst state while txFrames is empty. If it starts reading a host byte after
+        // this check, the burst will be aborted before being sent.
+        if(!isIdle() || !rxBytes.empty())
+        {
+            sendingStatus_=TransmissionStatus::Interrupted;
+            return false;
+        }
+        numBurstBytesSent_=0;
+        frameInterrupted_=false;
+        burstIsReply_=isReply;
+        sendingStatus_=TransmissionStatus::InProgress;
+        txFrames.push(frames, count);
+        // The timer may be stopped while the bus is idle. Instead of restarting it from here, which would race
+        // with the ISRs, let the EXTI ISR do it.
+        NVIC_SetPendingIRQ(CLK_EXTI_IRQn);
+        return true;
+    }
+
+    // Called after the last rising edge of CLK in the frame
+    void handleTxEndISR()
+    {
+        txClkStream.clearFlags();
+        if(nextState!=State::SendingByte_HardwareSequenced)
+            return;
+        finishByteSending(hostInhibitedTransmission() ? TransmissionStatus::Interrupted
+                                                      : TransmissionStatus::Complete);
     }
 
-    void handleISR()
+    void handleEdgeISR()
     {
-        switch(nextState)
+        if(nextState==State::SendingByte_HardwareSequenced)
         {
-        case State::WaitingForEvents:
+            // Only falling edges of CLK made by the host are unmasked while a frame is being sent
+            if(EXTI->PR & EXTI->IMR & CLK_EXTI_LINE)
+                finishByteSending(TransmissionStatus::Interrupted);
+            return;
+        }
+        if(!(EXTI->PR & EXTI->IMR & BUS_EXTI_LINES))
         {
-            // Make sure we don't hold the bus
-            high(CLK_PIN);
-            high(DATA_PIN);
-            // Check bus state
-            const bool clk =read( CLK_PIN);
-            const bool data=read(DATA_PIN);
-            if(clk && data)
-            {
-                if(numTicksBusFree<NUM_TICKS_TO_MARK_BUS_AS_FREE)
-                    ++numTicksBusFree;
+            // Not an edge we were waiting for, so we've been pended by sendBytes()
+            wakeUp();
+            return;
+        }
+        EXTI->IMR &= ~BUS_EXTI_LINES;
+        EXTI->PR = BUS_EXTI_LINES;
+        // Whatever the edge was, the bus can't be considered free until it's been idle for a while again
+        numTicksBusFree=0;
+        startTickTimer();
+    }
 
-                if(numTicksBusFree==NUM_TICKS_TO_MARK_BUS_AS_FREE)
-                    busState=BusState::Free;
-                else
-                    busState=BusState::Freeing;
-            }
-            else
-            {
-                // Bus has become non-free
-                numTicksBusFree=0;
-                if(!clk && data)
-                    busState=BusState::Inhibit;
-                else if(clk && !data)
-                    busState=BusState::ReqToSend;
-                else
-                    busState=BusState::Low;
-            }
+    void handleISR();
 
-            if(busState==BusState::ReqToSend && !byteReceivedAvailable_) // Only read a new byte if previous one has been consumed
-                switchToByteReceiveState();
-            else if(busState==BusState::Free && needToSendByte)
-                switchToByteSendState();
-            break;
-        }
+#ifdef ENABLE_ISR_PROFILING
+    // Not static so that it's easy to find from the debugger: print busDriver.profile
+    struct Profile
+    {
+        CycleStats states[unsigned(State::NumStates)]; // State handlers, indexed by the state handled
+        CycleStats tickISR;                            // Whole TIM3 interrupt handler
+        // Number of TIM3 interrupts that took longer than a tick, which means that the next timer
+        // event may have been handled late
+        uint32_t overruns=0;
+    };
+    volatile Profile profile;
 
-        case State::SendingByte_UpdateDATA:
-        {
-            const uint8_t bit=byteToSend&1;
-            if(numBitsSent==0)
-            {
-                // Start bit
-                low(DATA_PIN);
-            }
-            else if(numBitsSent<9)
-            {
-                if(bit) high(DATA_PIN); else low(DATA_PIN);
-                byteToSend >>= 1;
-                parityToSend ^= bit;
-            }
-            else if(numBitsSent==9)
-            {
-                // Parity bit
-                if(parityToSend) high(DATA_PIN); else low(DATA_PIN);
-            }
-            else if(numBitsSent==10)
-            {
-                // Stop bit
-                high(DATA_PIN);
-            }
-            else if(numBitsSent==11)
-            {
-                sendingStatus_=TransmissionStatus::Complete;
-                needToSendByte=false;
-                nextState=State::WaitingForEvents;
-                break;
-            }
-            ++numBitsSent;
-            nextState=State::SendingByte_LowerCLK;
-            break;
-        }
+    void recordTickISRCycles(const uint32_t cycles)
+    {
+        profile.tickISR.add(cycles);
+        if(cycles>tickTimerPeriod)
+            ++profile.overruns;
+    }
 
-        case State::SendingByte_LowerCLK:
-            if(!read(CLK_PIN))
-            {
-                // Inhibit condition detected
-                sendingStatus_=TransmissionStatus::Interrupted;
-                needToSendByte=false;
-                nextState=State::WaitingForEvents;
-                break;
-            }
-            low(CLK_PIN);
-            nextState=State::SendingByte_WaitingBeforeRaisingCLK;
-            break;
-        case State::SendingByte_WaitingBeforeRaisingCLK:
-            nextState=State::SendingByte_RaiseCLK;
-            break;
-        case State::SendingByte_RaiseCLK:
-            high(CLK_PIN);
-            nextState=State::SendingByte_UpdateDATA;
-            break;
-        case State::ReadingHostByte_LowerCLK:
-            if(byteReceivedAvailable_) break; // The byte hasn't been consumed yet.
-            if(!read(CLK_PIN))
-            {
-                // Host aborted the transmission
-                nextState=State::WaitingForEvents;
-                break;
-            }
-            low(CLK_PIN);
-            nextState=State::ReadingHostByte_WaitingBeforeRaisingCLK;
-            break;
-        case State::ReadingHostByte_WaitingBeforeRaisingCLK:
-            nextState=State::ReadingHostByte_RaiseCLKAndReadDATA;
-            break;
-        case State::ReadingHostByte_RaiseCLKAndReadDATA:
+    void reportProfile() const
+    {
+        static const char*const stateNames[]={
+            "WaitingForEvents",
+            "SendingByte_HardwareSequenced",
+            "ReadingHostByte_FirstLowerCLK",
+            "ReadingHostByte_LowerCLK",
+            "ReadingHostByte_RaiseCLKAndReadDATA",
+            "ReadingHostByte_SendingAckBit_LowerDATA",
+            "ReadingHostByte_SendingAckBit_LowerCLK",
+            "ReadingHostByte_SendingAckBit_RaiseCLK",
+            "ReadingHostByte_SendingAckBit_RaiseDATA",
+            "ReadingHostByte_SendingAckBit_FinalCLKLowering",
+            "ReadingHostByte_SendingAckBit_FinalCLKRaise",
+        };
+        static_assert(sizeof stateNames / sizeof stateNames[0]==unsigned(State::NumStates));
+
+        const auto report=[](const char* name, const CycleStats& s)
         {
-            high(CLK_PIN);
-            const uint8_t bit=!!read(DATA_PIN);
-            if(numBitsReceived<9)
-            {
-                // Data bit
-                byteReceived = byteReceived>>1 | bit<<7;
-                parityOfBitsReceived ^= bit;
-            }
-            else if(numBitsReceived==9)
-            {
-                // Parity bit
-                parityOfBitsReceived ^= bit;
-            }
-            else if(numBitsReceived==10)
-            {
-                // Stop bit
-                if(bit && !parityOfBitsReceived)
-                {
-                    receptionStatus_=TransmissionStatus::Complete;
-                    byteReceivedAvailable_=true;
-                }
-                else
-                {
-                    receptionStatus_=TransmissionStatus::Failed;
-                }
-                nextState=State::ReadingHostByte_SendingAckBit_LowerDATA;
-                break;
-            }
-            ++numBitsReceived;
-            nextState=State::ReadingHostByte_WaitingBeforeLoweringCLK;
-            break;
-        }
-        case State::ReadingHostByte_WaitingBeforeLoweringCLK:
-            if(read(CLK_PIN))
-                nextState=State::ReadingHostByte_LowerCLK;
-            else
-                nextState=State::WaitingForEvents; // Host aborted the transmission
-            break;
-        case State::ReadingHostByte_SendingAckBit_LowerDATA:
-            low(DATA_PIN);
-            nextState=State::ReadingHostByte_SendingAckBit_LowerCLK;
-            break;
-        case State::ReadingHostByte_SendingAckBit_LowerCLK:
-            low(CLK_PIN);
-            nextState=State::ReadingHostByte_SendingAckBit_WaitingBeforeRaisingCLK;
-            break;
-        case State::ReadingHostByte_SendingAckBit_WaitingBeforeRaisingCLK:
-            high(CLK_PIN);
-            nextState=State::ReadingHostByte_SendingAckBit_RaisingDATA;
-            break;
-        case State::ReadingHostByte_SendingAckBit_RaisingDATA:
-            high(DATA_PIN);
-            nextState=State::ReadingHostByte_SendingAckBit_FinalCLKLowering;
-            break;
-        case State::ReadingHostByte_SendingAckBit_FinalCLKLowering:
-            low(CLK_PIN);
-            nextState=State::ReadingHostByte_SendingAckBit_WaitingBeforeFinalCLKRaise;
-            break;
-        case State::ReadingHostByte_SendingAckBit_WaitingBeforeFinalCLKRaise:
-            nextState=State::ReadingHostByte_SendingAckBit_FinalCLKRaise;
-            break;
-        case State::ReadingHostByte_SendingAckBit_FinalCLKRaise:
-            high(CLK_PIN);
-            // FIXME: we aren't clocking in until the host releases the DATA line (when this happens
-            // to be needed, it's an error, but the protocol seems to require this from the device).
-            nextState=State::WaitingForEvents;
-            break;
-        }
+            if(!s.count) return;
+            USBH_UsrLog("  %s: count %lu, min %lu, max %lu, mean %lu", name, s.count, s.min, s.max, s.mean());
+        };
+        USBH_UsrLog("ISR cycles (one tick is %lu cycles), %lu overruns:", tickTimerPeriod, profile.overruns);
+        report("TIM3 interrupt", profile.tickISR.snapshot());
+        for(unsigned i=0; i<unsigned(State::NumStates); ++i)
+            report(stateNames[i], profile.states[i].snapshot());
     }
-} busDriver;
+#endif
+};
+
+}
+
+FASTCONST constexpr BusDriver::StateTable BusDriver::stateTable=BusDriver::makeStateTable({
+    {State::WaitingForEvents,                               &BusDriver::waitForEvents,                    1},
+    {State::SendingByte_HardwareSequenced,                  &BusDriver::sendByteHardwareSequenced,        1},
+    // CLK is held low and high for two ticks each while reading host bytes. It's first lowered a tick after the
+    // request to send has been seen.
+    {State::ReadingHostByte_FirstLowerCLK,                  &BusDriver::readHostByte_LowerCLK,            1},
+    {State::ReadingHostByte_LowerCLK,                       &BusDriver::readHostByte_LowerCLK,            2},
+    {State::ReadingHostByte_RaiseCLKAndReadDATA,            &BusDriver::readHostByte_RaiseCLKAndReadDATA, 2},
+    {State::ReadingHostByte_SendingAckBit_LowerDATA,        &BusDriver::sendAckBit_LowerDATA,             1},
+    {State::ReadingHostByte_SendingAckBit_LowerCLK,         &BusDriver::sendAckBit_LowerCLK,              1},
+    {State::ReadingHostByte_SendingAckBit_RaiseCLK,         &BusDriver::sendAckBit_RaiseCLK,              1},
+    {State::ReadingHostByte_SendingAckBit_RaiseDATA,        &BusDriver::sendAckBit_RaiseDATA,             1},
+    {State::ReadingHostByte_SendingAckBit_FinalCLKLowering, &BusDriver::sendAckBit_FinalCLKLowering,      1},
+    {State::ReadingHostByte_SendingAckBit_FinalCLKRaise,    &BusDriver::sendAckBit_FinalCLKRaise,         2},
+});
 
-extern "C" void TIM3_IRQHandler()
+RAMFUNC void BusDriver::handleISR()
 {
+    static_assert(isComplete(stateTable), "Each state must have a handler and a nonzero delay");
+#ifdef ENABLE_ISR_PROFILING
+    const State stateHandled=nextState;
+    const uint32_t start=DWT->CYCCNT;
+#endif
+    const State state=(this->*stateTable.entries[unsigned(nextState)].handler)();
+#ifdef ENABLE_ISR_PROFILING
+    profile.states[unsigned(stateHandled)].add(DWT->CYCCNT-start);
+#endif
+    nextState=state;
+    setTicksToNextTimerISR(stateTable.entries[unsigned(state)].ticksBefore);
+}
+
+FASTDATA BusDriver busDriver;
+
+extern "C" RAMFUNC void TIM3_IRQHandler()
+{
+#ifdef ENABLE_ISR_PROFILING
+    const uint32_t start=DWT->CYCCNT;
+#endif
     busDriver.handleISR();
     TIM3->SR &= ~TIM_IT_UPDATE;
+#ifdef ENABLE_ISR_PROFILING
+    busDriver.recordTickISRCycles(DWT->CYCCNT-start);
+#endif
+}
+
+extern "C" RAMFUNC void TX_CLK_DMA_IRQHandler()
+{
+    busDriver.handleTxEndISR();
+}
 
-    ++autorepeatTickCounter;
+extern "C" RAMFUNC void CLK_EXTI_IRQHandler()
+{
+    busDriver.handleEdgeISR();
 }
 
+extern "C" RAMFUNC void DATA_EXTI_IRQHandler()
+{
+    busDriver.handleEdgeISR();
+}
+
+// Raises the clock rate step by step while the host keeps up with it, and backs off when the host starts
+// requesting resends or inhibiting transmissions. Only active if ENABLE_PS2_CLOCK_PROBING is defined.
+class ClockRateProber
+{
+    // The host must accept the default rate, so we never go below it
+    static constexpr uint32_t rates[]={DEFAULT_CLK_RATE, 14300, MAX_CLK_RATE};
+    static constexpr unsigned NUM_RATES=sizeof rates/sizeof rates[0];
+    static constexpr unsigned DEFAULT_RATE_INDEX=0;
+    static_assert(rates[DEFAULT_RATE_INDEX]==DEFAULT_CLK_RATE);
+    // Number of bytes the host must accept without problems before we try the next rate
+    static constexpr unsigned NUM_GOOD_BYTES_TO_STEP_UP=256;
+    // Number of bytes the host must accept without problems at the ceiling before we raise it again. The trouble
+    // that lowered it may have been temporary, e.g. the host being busy with something else.
+    static constexpr unsigned NUM_GOOD_BYTES_TO_RAISE_CEILING=4096;
+    // Number of frames in a row interrupted by the host that make us consider current rate too fast
+    static constexpr unsigned NUM_INHIBITS_TO_BACK_OFF=4;
+
+    uint8_t rateIndex=DEFAULT_RATE_INDEX;
+    uint8_t maxRateIndex=NUM_RATES-1; // Lowered each time we back off, so that we don't oscillate
+    uint16_t numGoodBytes=0;
+    uint8_t numInhibitsInRow=0;
+
+    void backOff()
+    {
+        numGoodBytes=0;
+        numInhibitsInRow=0;
+        if(rateIndex==DEFAULT_RATE_INDEX) return;
+        maxRateIndex=--rateIndex;
+        busDriver.setClockRate(rates[rateIndex]);
+    }
+public:
+    void bytesSent(const unsigned count)
+    {
+#ifdef ENABLE_PS2_CLOCK_PROBING
+        numInhibitsInRow=0;
+        numGoodBytes+=count;
+        if(rateIndex<maxRateIndex)
+        {
+            if(numGoodBytes<NUM_GOOD_BYTES_TO_STEP_UP)
+                return;
+            numGoodBytes=0;
+            busDriver.setClockRate(rates[++rateIndex]);
+        }
+        else if(numGoodBytes>=NUM_GOOD_BYTES_TO_RAISE_CEILING)
+        {
+            numGoodBytes=0;
+            if(maxRateIndex<NUM_RATES-1)
+                ++maxRateIndex;
+        }
+#else
+        (void)count;
+#endif
+    }
+    // Only for frames interrupted on the wire: a burst aborted before it has started says nothing about the rate
+    void transmissionInhibited()
+    {
+#ifdef ENABLE_PS2_CLOCK_PROBING
+        if(++numInhibitsInRow>=NUM_INHIBITS_TO_BACK_OFF)
+            backOff();
+#endif
+    }
+    void resendRequested()
+    {
+#ifdef ENABLE_PS2_CLOCK_PROBING
+        backOff();
+#endif
+    }
+    // The host may have been replaced, or have reset the keyboard because it stopped understanding it
+    void reset()
+    {
+#ifdef ENABLE_PS2_CLOCK_PROBING
+        rateIndex=DEFAULT_RATE_INDEX;
+        maxRateIndex=NUM_RATES-1;
+        numGoodBytes=0;
+        numInhibitsInRow=0;
+        busDriver.setClockRate(DEFAULT_CLK_RATE);
+#endif
+    }
+} clockRateProber;
+
 static void setLEDs(uint8_t state)
 {
     setUSBKeyboardLEDs(state);
 }
 
-// Stores scan codes in the format: count=N|(modifiers...), byte1, byte2, ..., byteN
-RingBuffer<32> keyboardBuffer;
-uint8_t numBytesToReceiveInCurrentScanCode=0;
-bool beginningOfCurrentScanCodeWasSkipped=false;
+// Key transitions waiting to be typed. They're encoded into scan codes only when the bus is ready to send them.
+FASTDATA PowerOfTwoRingBuffer<16, KeyEvent> keyboardBuffer;
 
-uint8_t sentBytesFromCurrentScanCode=0;
-static void typeNextScanCode()
+// Returns the length of the scan code, which is zero if the key has none
+static unsigned encodeKeyEvent(const KeyEvent event, uint8_t (&bytes)[BusDriver::MAX_BURST_LENGTH])
 {
-    if(keyboardBuffer.empty()) return;
-    const auto count=keyboardBuffer[0];
-    if(count+1u>keyboardBuffer.size()) return; // Haven't read enough bytes from the controlling keyboard
-    if(!busDriver.isIdle()) return;
+    const bool ctrl =event.flags & KEY_EVENT_CTRL;
+    const bool shift=event.flags & KEY_EVENT_SHIFT;
+    const bool alt  =event.flags & KEY_EVENT_ALT;
+    const bool numLockLED=event.flags & KEY_EVENT_NUM_LOCK;
+    // Scan codes are in the format {byteCount, byte1, byte2, ..., byteN}
+    const uint8_t*const code = event.flags & KEY_EVENT_BREAK ?
+                                    keyToBreakCode(event.key, ctrl, shift, alt, numLockLED) :
+                                    keyToMakeCode(event.key, ctrl, shift, alt, numLockLED,
+                                                  event.flags & KEY_EVENT_AUTOREPEAT);
+    if(!code || code[0]>BusDriver::MAX_BURST_LENGTH) return 0;
+    for(unsigned n=0; n<code[0]; ++n)
+        bytes[n]=code[n+1];
+    return code[0];
+}
+
+// Key output is scheduled with strict priority between three classes:
+//  1. replies to host commands, which are sent by PS2_Process() states before any key output is considered,
+//  2. key transitions (makes and breaks) from keyboardBuffer,
+//  3. typematic repeats, of which only the latest one is kept in pendingRepeat.
+// A repeat is only sent when no transitions are waiting, and is dropped right away if the transitions have
+// piled up, so that a host inhibiting the bus doesn't make real key presses and releases wait behind repeats.
+// Any transition queued after a pending repeat cancels it, so that no repeat is sent out of order.
+constexpr unsigned REPEAT_BACKLOG_THRESHOLD=4; // Transitions in keyboardBuffer above which repeats are dropped
+static KeyEvent pendingRepeat;
+static bool hasPendingRepeat=false;
 
-    if(sentBytesFromCurrentScanCode<count)
+bool currentScanCodeIsBeingSent=false;
+// The event whose scan code is being sent. A transition also stays at the front of keyboardBuffer until it's
+// been sent, so that it's retransmitted if interrupted. A repeat has already been taken from pendingRepeat.
+static KeyEvent eventBeingSent;
+static bool repeatIsBeingSent=false;
+
+
+class KeySet
+{
+    uint32_t bits_[256/32]={};
+public:
+    bool contains(const uint8_t key) const { return bits_[key/32] & 1u<<key%32; }
+    void insert(const uint8_t key) { bits_[key/32] |= 1u<<key%32; }
+    void erase(const uint8_t key) { bits_[key/32] &= ~(1u<<key%32); }
+    void clear() { for(auto& b : bits_) b=0; }
+    bool empty() const
+    {
+        for(const auto b : bits_)
+            if(b) return false;
+        return true;
+    }
+    // Returns false if the set is empty
+    bool first(uint8_t& key) const
     {
-        enum class State
+        for(unsigned n=0; n<256/32; ++n)
         {
-            Idle,
-            WaitingForCompletion,
-        };
-        static State state=State::Idle;
-        switch(state)
+            if(!bits_[n]) continue;
+            key=n*32+__builtin_ctz(bits_[n]);
+            return true;
+        }
+        return false;
+    }
+};
+// Keys whose make has been dropped on overflow: their repeats and break must be dropped too
+static KeySet keysWithDroppedMakes;
+// Keys whose break has to be sent as soon as keyboardBuffer has room for it
+static KeySet pendingBreaks;
+
+static bool isBreak(const KeyEvent& event) { return event.flags & KEY_EVENT_BREAK; }
+static bool isRepeat(const KeyEvent& event) { return event.flags & KEY_EVENT_AUTOREPEAT; }
+
+static void flushPendingBreaks()
+{
+    uint8_t key;
+    while(keyboardBuffer.size()<keyboardBuffer.capacity() && pendingBreaks.first(key))
+    {
+        // The modifier state at the time of release is lost, but a plain break code releases the key anyway
+        keyboardBuffer.push_back({key, KEY_EVENT_BREAK});
+        pendingBreaks.erase(key);
+    }
+}
+
+// The event at the front of keyboardBuffer may be being sent, then it must stay
+static unsigned firstRemovableEvent()
+{
+    return currentScanCodeIsBeingSent && !repeatIsBeingSent ? 1 : 0;
+}
+
+// Tries to free at least one entry in the full keyboardBuffer without losing any key state change
+static bool coalesceKeyboardBuffer()
+{
+    const unsigned firstRemovable=firstRemovableEvent();
+    // Look for a make and the following break of the same key: together they don't change the key state
+    for(unsigned m=firstRemovable; m<keyboardBuffer.size(); ++m)
+    {
+        const auto make=keyboardBuffer[m];
+        if(isBreak(make)) continue;
+        for(unsigned b=m+1; b<keyboardBuffer.size(); ++b)
+        {
+            const auto event=keyboardBuffer[b];
+            if(event.key!=make.key) continue;
+            if(!isBreak(event)) break; // Another make of the same key, can't pair across it
+            keyboardBuffer.erase(b);
+            keyboardBuffer.erase(m);
+            ++pipelineStats.pairsCancelled;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void queueRepeat(const KeyEvent event)
+{
+    // The host hasn't seen this key pressed, or has already seen it released
+    if(keysWithDroppedMakes.contains(event.key) || pendingBreaks.contains(event.key))
+        return;
+    if(keyboardBuffer.size()>REPEAT_BACKLOG_THRESHOLD || hasPendingRepeat)
+        ++pipelineStats.repeatsCollapsed;
+    if(keyboardBuffer.size()>REPEAT_BACKLOG_THRESHOLD)
+        return;
+    pendingRepeat=event;
+    hasPendingRepeat=true;
+}
+
+// When keyboardBuffer is full, events are coalesced instead of being dropped, so that the host never misses
+// a break code and ends up with a stuck key. Each action is counted in pipelineStats.
+static void pushKeyEventWithoutLoss(const KeyEvent event)
+{
+    // Transitions are sent before repeats, so a repeat queued earlier would follow this one, e.g. the release
+    // of its key. A keyboard stops repeating on any transition anyway.
+    hasPendingRepeat=false;
+
+    if(keysWithDroppedMakes.contains(event.key))
+    {
+        // The host hasn't seen this key pressed, so it mustn't see it released
+        if(isBreak(event))
+            keysWithDroppedMakes.erase(event.key);
+        return;
+    }
+    if(!isBreak(event) && pendingBreaks.contains(event.key))
+    {
+        // The host still thinks the key is held, and now it is again
+        pendingBreaks.erase(event.key);
+        ++pipelineStats.pairsCancelled;
+        return;
+    }
+
+    flushPendingBreaks();
+    if(keyboardBuffer.size()<keyboardBuffer.capacity() && !pendingBreaks.contains(event.key))
+    {
+        keyboardBuffer.push_back(event);
+        return;
+    }
+
+    USBH_UsrLog("Keyboard buffer is full, coalescing events");
+    if(isBreak(event))
+    {
+        // If the make of this key hasn't been sent yet, the pair cancels out
+        for(unsigned n=keyboardBuffer.size(); n-- > firstRemovableEvent();)
         {
-        case State::Idle:
-            busDriver.sendByte(keyboardBuffer[sentBytesFromCurrentScanCode+1]);
-            state=State::WaitingForCompletion;
+            const auto queued=keyboardBuffer[n];
+            if(queued.key!=event.key) continue;
+            if(isBreak(queued)) break;
+            keyboardBuffer.erase(n);
+            ++pipelineStats.pairsCancelled;
             return;
-        case State::WaitingForCompletion:
-            if(!busDriver.isIdle())
-                return;
-            state=State::Idle;
-            const auto status=busDriver.sendingStatus();
-            if(status==BusDriver::TransmissionStatus::Complete)
-                ++sentBytesFromCurrentScanCode;
-            if(status==BusDriver::TransmissionStatus::Interrupted)
-                sentBytesFromCurrentScanCode=0; // must re-transmit the whole chunk
-            if(sentBytesFromCurrentScanCode!=count)
-                return; // Will continue in the next call
-            break;
         }
     }
-    sentBytesFromCurrentScanCode=0;
-    // Remove the finished scan code atomically: we want to make sure the first
-    // byte, if present, always denotes the length of the scan code, even in ISR.
-    __disable_irq();
-    for(uint8_t i=0;i<count+1;++i)
+    if(coalesceKeyboardBuffer())
+    {
+        keyboardBuffer.push_back(event);
+        return;
+    }
+    if(isBreak(event))
+    {
+        pendingBreaks.insert(event.key);
+        ++pipelineStats.breaksDeferred;
+    }
+    else
+    {
+        keysWithDroppedMakes.insert(event.key);
+        ++pipelineStats.makesDropped;
+    }
+}
+
+// Must be called when the bus driver has become idle after sending the scan code of eventBeingSent
+static void finishScanCode()
+{
+    currentScanCodeIsBeingSent=false;
+    // The scan code is generated anew when needed, it's cheaper than storing it
+    uint8_t bytes[BusDriver::MAX_BURST_LENGTH];
+    const auto count=encodeKeyEvent(eventBeingSent, bytes);
+    if(busDriver.sendingStatus()!=BusDriver::TransmissionStatus::Complete)
+    {
+        USBH_UsrLog("Scan code interrupted after %u of %u bytes, will retransmit",
+                    (unsigned)busDriver.numBurstBytesSent(), (unsigned)count);
+        if(busDriver.frameInterrupted())
+            clockRateProber.transmissionInhibited();
+        ++pipelineStats.interruptedRestarts;
+        // A transition must be re-transmitted as a whole, and stays at the front of keyboardBuffer for this.
+        // A repeat isn't worth it: there will be another one soon unless the key has been released.
+        if(repeatIsBeingSent)
+            ++pipelineStats.repeatsCollapsed;
+        return;
+    }
+    clockRateProber.bytesSent(count);
+
+    // keyboardBuffer is only accessed from the main loop, so the event can be removed without masking
+    // interrupts: the ISR only sees the scan code that was passed to sendBytes().
+    if(!repeatIsBeingSent)
+    {
         keyboardBuffer.pop_front();
-    __enable_irq();
+        flushPendingBreaks();
+    }
+}
+
+static void typeNextScanCode()
+{
+    if(!busDriver.isIdle()) return;
+
+    if(currentScanCodeIsBeingSent)
+    {
+        finishScanCode();
+        return;
+    }
+
+    KeyEvent event;
+    if(!keyboardBuffer.empty())
+    {
+        event=keyboardBuffer.front();
+        repeatIsBeingSent=false;
+    }
+    else if(hasPendingRepeat)
+    {
+        event=pendingRepeat;
+        hasPendingRepeat=false;
+        repeatIsBeingSent=true;
+    }
+    else
+    {
+        return;
+    }
+
+    uint8_t bytes[BusDriver::MAX_BURST_LENGTH];
+    const auto count=encodeKeyEvent(event, bytes);
+    if(count==0)
+    {
+        if(!repeatIsBeingSent)
+            keyboardBuffer.pop_front();
+        return;
+    }
+    // The host may have started sending a command since the bus was found idle. Then nothing has been sent, so
+    // it's no interrupted transmission: the event is just kept for later.
+    if(!busDriver.sendBytes(bytes, count))
+    {
+        if(repeatIsBeingSent)
+        {
+            pendingRepeat=event;
+            hasPendingRepeat=true;
+        }
+        return;
+    }
+    eventBeingSent=event;
+    pipelineStats.scanCodeBytesQueued+=count;
+    currentScanCodeIsBeingSent=true;
+}
+
+// Whether PS2_Process() is in the state where it types scan codes. Lets passKeyEventsToPS2() start sending
+// right away instead of leaving it to the next main loop iteration.
+static bool typingAllowed=false;
+
+// Starts sending a reply to the last byte from the host. The bus driver records how long the host has waited
+// for it.
+static void sendReply(const uint8_t* bytes, const uint8_t count)
+{
+    busDriver.sendBytes(bytes, count, true);
+}
+static void sendReply(const uint8_t byte)
+{
+    sendReply(&byte, 1);
 }
 
 static void clearKbdBuffer()
 {
-    if(numBytesToReceiveInCurrentScanCode)
-        beginningOfCurrentScanCodeWasSkipped=true;
     keyboardBuffer.clear();
-    sentBytesFromCurrentScanCode=0;
+    // Deferred key state changes are discarded along with the queued ones
+    keysWithDroppedMakes.clear();
+    pendingBreaks.clear();
+    hasPendingRepeat=false;
+    currentScanCodeIsBeingSent=false;
 }
 
 void PS2_Process()
@@ -531,6 +1354,8 @@ void PS2_Process()
         SendingBAT_WaitingForTransmissionEnd,
         ReplyingWithResend,
         ReplyingWithEcho,
+        ReplyingWithID,
+        ReplyingWithID_WaitingForTransmissionEnd,
         ResendingLastByte,
         SettingLEDs,
     };
@@ -541,6 +1366,24 @@ void PS2_Process()
     static KeyboardState stateToGoToAfterAck;
     static uint8_t setLEDsCmdArg;
     static uint32_t BATStartTimeMs;
+    static uint32_t argumentWaitStartTimeMs;
+#ifdef ENABLE_ISR_PROFILING
+    static uint32_t lastProfileReportTimeMs;
+    if(HAL_GetTick() - lastProfileReportTimeMs >= ISR_PROFILE_REPORT_PERIOD_MS)
+    {
+        lastProfileReportTimeMs=HAL_GetTick();
+        busDriver.reportProfile();
+    }
+#endif
+#ifdef ENABLE_DEBUG_OUTPUT
+    static uint32_t lastStatsReportTimeMs;
+    if(HAL_GetTick() - lastStatsReportTimeMs >= PIPELINE_STATS_REPORT_PERIOD_MS)
+    {
+        lastStatsReportTimeMs=HAL_GetTick();
+        PipelineStats_Report();
+    }
+#endif
+    typingAllowed=false;
     switch(kbdState)
     {
     case KeyboardState::Initialization:
@@ -571,6 +1414,15 @@ void PS2_Process()
         break;
     case KeyboardState::WaitingForCommands:
         kbdBusy=false;
+        if(currentScanCodeIsBeingSent &&
+           (busDriver.receptionStatus()==BusDriver::TransmissionStatus::Failed || busDriver.byteReceivedAvailable()))
+        {
+            // Our reply will replace the sending status, so find out first whether the scan code has to be
+            // retransmitted. If it hasn't been sent yet, the bus driver will abort it shortly.
+            if(!busDriver.isIdle())
+                break;
+            finishScanCode();
+        }
         if(busDriver.receptionStatus()==BusDriver::TransmissionStatus::Failed)
         {
             busDriver.clearReceptionStatus();
@@ -614,20 +1466,20 @@ void PS2_Process()
                 return;
             }
 
+            // Keystrokes are kept while a command is being handled: output is paused, since we only type them
+            // in this state. Only the commands that reset the keyboard state discard them.
             const auto cmd=byte;
-            if(cmd!=CMD_RESEND)
-            {
+            PipelineStats_CountHostCommand(cmd);
+            if(cmd==CMD_RESET)
                 kbdBusy=true;
+            if(cmd==CMD_RESET || cmd==CMD_SET_DEFAULT)
                 clearKbdBuffer();
-            }
 
             switch(cmd)
             {
             case CMD_READ_ID:
-                keyboardBuffer.push_back(3);
-                keyboardBuffer.push_back(REPLY_ACKNOWLEDGE);
-                keyboardBuffer.push_back(REPLY_ID_BYTE_0);
-                keyboardBuffer.push_back(REPLY_ID_BYTE_1);
+                kbdState=KeyboardState::ReplyingWithID;
+                USBH_UsrLog("Handling CMD_READ_ID");
                 break;
             case CMD_SET_TYPEMATIC_RATE:
             case CMD_SET_SCAN_CODE_SET:
@@ -639,6 +1491,7 @@ void PS2_Process()
                 break;
             }
             case CMD_RESET:
+                clockRateProber.reset();
                 kbdState=KeyboardState::SendingACK;
                 stateToGoToAfterAck=KeyboardState::Initialization;
                 USBH_UsrLog("Handling CMD_RESET");
@@ -659,6 +1512,7 @@ void PS2_Process()
                 break;
             case CMD_RESEND:
                 kbdState=KeyboardState::ResendingLastByte;
+                clockRateProber.resendRequested();
                 USBH_UsrLog("Handling CMD_RESEND");
                 break;
             case CMD_SET_KEY_TYPE_MAKE:
@@ -678,13 +1532,18 @@ void PS2_Process()
                 break;
             }
         }
-        else if(kbdEnabled && !keyboardBuffer.empty())
+        else if(kbdEnabled && (!(lastCommand&0x80) ||
+                               HAL_GetTick()-argumentWaitStartTimeMs > COMMAND_ARGUMENT_TIMEOUT_MS))
+        {
+            // While the host is about to send the argument of its command, it doesn't expect scan codes
+            typingAllowed=true;
             typeNextScanCode();
+        }
         break;
     case KeyboardState::SendingACK:
         if(!busDriver.isIdle())
             break;
-        busDriver.sendByte(REPLY_ACKNOWLEDGE);
+        sendReply(REPLY_ACKNOWLEDGE);
         kbdState=KeyboardState::SendingACK_WaitingForTransmissionEnd;
         break;
     case KeyboardState::SendingACK_WaitingForTransmissionEnd:
@@ -713,24 +1572,50 @@ void PS2_Process()
         break;
     case KeyboardState::SavingLastCommand:
         lastCommand=lastCmdToSetAfterAck;
+        argumentWaitStartTimeMs=HAL_GetTick();
         kbdState=KeyboardState::WaitingForCommands;
         break;
     case KeyboardState::ReplyingWithResend:
         if(!busDriver.isIdle())
             break;
-        busDriver.sendByte(REPLY_RESEND);
+        sendReply(REPLY_RESEND);
+        ++pipelineStats.resendReplies;
         kbdState=KeyboardState::WaitingForCommands;
         break;
     case KeyboardState::ReplyingWithEcho:
         if(!busDriver.isIdle())
             break;
-        busDriver.sendByte(REPLY_ECHO);
+        sendReply(REPLY_ECHO);
+        kbdState=KeyboardState::WaitingForCommands;
+        break;
+    case KeyboardState::ReplyingWithID:
+    {
+        if(!busDriver.isIdle())
+            break;
+        static const uint8_t reply[]={REPLY_ACKNOWLEDGE, REPLY_ID_BYTE_0, REPLY_ID_BYTE_1};
+        sendReply(reply, sizeof reply);
+        kbdState=KeyboardState::ReplyingWithID_WaitingForTransmissionEnd;
+        break;
+    }
+    case KeyboardState::ReplyingWithID_WaitingForTransmissionEnd:
+        if(!busDriver.isIdle())
+            break;
+        // Like a scan code, the ID is retransmitted as a whole if the host has inhibited the bus while it was
+        // being sent. If the host has sent something instead, that has to be handled first.
+        if(busDriver.sendingStatus()!=BusDriver::TransmissionStatus::Complete &&
+           !busDriver.byteReceivedAvailable() &&
+           busDriver.receptionStatus()!=BusDriver::TransmissionStatus::Failed)
+        {
+            USBH_UsrLog("ID reply interrupted after %u bytes, will retransmit", (unsigned)busDriver.numBurstBytesSent());
+            kbdState=KeyboardState::ReplyingWithID;
+            break;
+        }
         kbdState=KeyboardState::WaitingForCommands;
         break;
     case KeyboardState::ResendingLastByte:
         if(!busDriver.isIdle())
             break;
-        busDriver.sendByte(lastSentByte);
+        sendReply(busDriver.lastSentByte());
         kbdState=KeyboardState::WaitingForCommands;
         break;
     case KeyboardState::SettingLEDs:
@@ -740,44 +1625,45 @@ void PS2_Process()
     }
 }
 
-void passByteToPS2(uint8_t data)
+void passKeyEventsToPS2(const KeyEvent* events, const unsigned count)
 {
-    USBH_UsrLog("pass byte to PS/2: %02X", (unsigned)data);
-    // We get scan codes in the format {byteCount, byte1, byte2, ..., byteN}
-
-    if(numBytesToReceiveInCurrentScanCode==0)
-    {
-        // New scan code begins, save length
-        numBytesToReceiveInCurrentScanCode=data;
-        if(kbdEnabled && !kbdBusy)
-            beginningOfCurrentScanCodeWasSkipped=false;
-    }
-    else
+    USBH_UsrLog("pass %u key events to PS/2, first: key %02X, flags %02X", count,
+                (unsigned)events[0].key, (unsigned)events[0].flags);
+    if(!kbdEnabled || kbdBusy)
     {
-        --numBytesToReceiveInCurrentScanCode;
+        pipelineStats.keyEventsDiscarded+=count;
+        return;
     }
 
-    if(1+numBytesToReceiveInCurrentScanCode+keyboardBuffer.size()>keyboardBuffer.capacity())
+    // Usual case: nothing has been deferred or dropped, and the transitions fit, so they can be appended in
+    // one step without looking at each one against the buffer contents.
+    bool onlyTransitions=true;
+    for(unsigned n=0; n<count; ++n)
+        onlyTransitions = onlyTransitions && !isRepeat(events[n]);
+    if(onlyTransitions && pendingBreaks.empty() && keysWithDroppedMakes.empty() &&
+       keyboardBuffer.push(events, count))
     {
-        // Avoid overflowing the buffer, since in this case we'll lose sync between scan code bytes and lengths
-        beginningOfCurrentScanCodeWasSkipped=true;
-        return;
+        // As in pushKeyEventWithoutLoss(), a repeat mustn't follow a transition queued after it
+        hasPendingRepeat=false;
     }
-
-    // Only now can we check this and quit if needed, because the bookkeeping above is always required, or
-    // buffer will become inconsistent due to unnoticed skipping of length byte.
-    if(!kbdEnabled || kbdBusy)
+    else
     {
-        if(numBytesToReceiveInCurrentScanCode)
-            beginningOfCurrentScanCodeWasSkipped=true;
-        return;
+        for(unsigned n=0; n<count; ++n)
+        {
+            if(isRepeat(events[n]))
+                queueRepeat(events[n]);
+            else
+                pushKeyEventWithoutLoss(events[n]);
+        }
     }
+    if(keyboardBuffer.size()>pipelineStats.keyboardBufferHighWater)
+        pipelineStats.keyboardBufferHighWater=keyboardBuffer.size();
 
-    // Don't try to store partial data: at the very least scan code should be preceeded by its length.
-    if(beginningOfCurrentScanCodeWasSkipped)
-        return;
-
-    keyboardBuffer.push_back(data);
+    // If the bus is idle, start sending now rather than after a whole main loop iteration. typingAllowed is as of
+    // the last PS2_Process() call, and the host may have sent a command since then, which must be handled first.
+    if(typingAllowed && !busDriver.byteReceivedAvailable() &&
+       busDriver.receptionStatus()!=BusDriver::TransmissionStatus::Failed)
+        typeNextScanCode();
 }
 
 static void initPS2ClockTimer()
@@ -787,7 +1673,7 @@ static void initPS2ClockTimer()
 
     TIM_HandleTypeDef tim={};
     tim.Instance=TIM3;
-    tim.Init.Period=SystemCoreClock/QUADRUPLE_CLK_RATE-1;
+    tim.Init.Period=tickTimerPeriod-1;
     tim.Init.Prescaler=0;
     tim.Init.ClockDivision=TIM_CLOCKDIVISION_DIV1;
     tim.Init.CounterMode=TIM_COUNTERMODE_UP;
@@ -9,10 +9,29 @@ extern "C"
 
 void PS2_Init(void);
 void PS2_Process(void);
-void passByteToPS2(uint8_t data);
-extern volatile uint32_t autorepeatTickCounter;
-extern uint32_t autorepeatPeriodInTicks;
-extern uint32_t autorepeatDelayInTicks;
+
+// Key event passed from the USB side. Scan codes of some keys depend on the state of modifiers and Num Lock,
+// so it's captured at the time of the event, and the scan code is only generated when it's about to be sent.
+typedef struct
+{
+    uint8_t key;   // HID usage ID
+    uint8_t flags; // KEY_EVENT_* bits
+} KeyEvent;
+enum
+{
+    KEY_EVENT_BREAK     =1<<0,
+    KEY_EVENT_AUTOREPEAT=1<<1,
+    KEY_EVENT_CTRL      =1<<2,
+    KEY_EVENT_SHIFT     =1<<3,
+    KEY_EVENT_ALT       =1<<4,
+    KEY_EVENT_NUM_LOCK  =1<<5,
+};
+// Passes all the events at once, e.g. the transitions detected in one USB report
+void passKeyEventsToPS2(const KeyEvent* events, unsigned count);
+
+// In ticks of TYPEMATIC_TICK_RATE, set by the host
+extern volatile uint32_t autorepeatPeriodInTicks;
+extern volatile uint32_t autorepeatDelayInTicks;
 
 #ifdef __cplusplus
 }
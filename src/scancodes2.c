@@ -2,8 +2,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <usbh_hid_keybd.h>
+#include "scancodes2.h"
+#include "hid-report-layout.h"
 
-#define KEY_MAX KEY_RIGHT_GUI+1
+#define KEY_MAX (KEY_WAKEUP+1)
 #define MAX_MAKE_CODE_LENGTH 2
 #define MAX_BREAK_CODE_LENGTH 3
 struct ScanCode
@@ -150,21 +152,6 @@ const struct ScanCode scanCodes[KEY_MAX] =
     [KEY_FIND]                              = {{0,},                  {0,}},
     [KEY_CUT]                               = {{0,},                  {0,}},
     [KEY_HELP]                              = {{0,},                  {0,}},
-// FIXME: what HID usages correspond to these commented out keys?
-//    [KEY_CALC]                              = {{2,0xE0,0x2B},         {3,0xE0,0xF0,0x2B}},
-//    [KEY_SLEEP]                             = {{2,0xE0,0x3F},         {3,0xE0,0xF0,0x3F}},
-//    [KEY_WAKEUP]                            = {{2,0xE0,0x5E},         {3,0xE0,0xF0,0x5E}},
-//    [KEY_MAIL]                              = {{2,0xE0,0x48},         {3,0xE0,0xF0,0x48}},
-//    [KEY_BOOKMARKS]                         = {{2,0xE0,0x18},         {3,0xE0,0xF0,0x18}},
-//    [KEY_COMPUTER]                          = {{2,0xE0,0x40},         {3,0xE0,0xF0,0x40}},
-//    [KEY_BACK]                              = {{2,0xE0,0x38},         {3,0xE0,0xF0,0x38}},
-//    [KEY_FORWARD]                           = {{2,0xE0,0x30},         {3,0xE0,0xF0,0x30}},
-//    [KEY_NEXTSONG]                          = {{2,0xE0,0x4D},         {3,0xE0,0xF0,0x4D}},
-//    [KEY_PLAYPAUSE]                         = {{2,0xE0,0x34},         {3,0xE0,0xF0,0x34}},
-//    [KEY_PREVIOUSSONG]                      = {{2,0xE0,0x15},         {3,0xE0,0xF0,0x15}},
-//    [KEY_STOPCD]                            = {{2,0xE0,0x3B},         {3,0xE0,0xF0,0x3B}},
-//    [KEY_HOMEPAGE]                          = {{2,0xE0,0x3A},         {3,0xE0,0xF0,0x3A}},
-//    [KEY_REFRESH]                           = {{2,0xE0,0x20},         {3,0xE0,0xF0,0x20}},
     [KEY_F13]                               = {{0,},                  {0,}},
     [KEY_F14]                               = {{0,},                  {0,}},
     [KEY_F15]                               = {{0,},                  {0,}},
@@ -177,16 +164,82 @@ const struct ScanCode scanCodes[KEY_MAX] =
     [KEY_F22]                               = {{0,},                  {0,}},
     [KEY_F23]                               = {{0,},                  {0,}},
     [KEY_F24]                               = {{0,},                  {0,}},
-// FIXME: what HID usages correspond to these commented out keys?
-//    [KEY_SEARCH]                            = {{2,0xE0,0x10},         {3,0xE0,0xF0,0x10}},
     [KEY_CANCEL]                            = {{0,},                  {0,}},
-//    [KEY_MEDIA]                             = {{2,0xE0,0x50},         {3,0xE0,0xF0,0x50}},
     [KEY_SELECT]                            = {{0,},                  {0,}},
     [KEY_CLEAR]                             = {{0,},                  {0,}},
 
     [KEY_NONUS_BACK_SLASH_VERTICAL_BAR]     = {{1,0x61},              {2,0xF0,0x61}},
+
+    // Consumer and System Control keys
+    [KEY_NEXTSONG]                          = {{2,0xE0,0x4D},         {3,0xE0,0xF0,0x4D}},
+    [KEY_PREVIOUSSONG]                      = {{2,0xE0,0x15},         {3,0xE0,0xF0,0x15}},
+    [KEY_STOPCD]                            = {{2,0xE0,0x3B},         {3,0xE0,0xF0,0x3B}},
+    [KEY_PLAYPAUSE]                         = {{2,0xE0,0x34},         {3,0xE0,0xF0,0x34}},
+    [KEY_CONSUMER_MUTE]                     = {{2,0xE0,0x23},         {3,0xE0,0xF0,0x23}},
+    [KEY_CONSUMER_VOLUME_UP]                = {{2,0xE0,0x32},         {3,0xE0,0xF0,0x32}},
+    [KEY_CONSUMER_VOLUME_DOWN]              = {{2,0xE0,0x21},         {3,0xE0,0xF0,0x21}},
+    [KEY_MEDIA]                             = {{2,0xE0,0x50},         {3,0xE0,0xF0,0x50}},
+    [KEY_MAIL]                              = {{2,0xE0,0x48},         {3,0xE0,0xF0,0x48}},
+    [KEY_CALC]                              = {{2,0xE0,0x2B},         {3,0xE0,0xF0,0x2B}},
+    [KEY_COMPUTER]                          = {{2,0xE0,0x40},         {3,0xE0,0xF0,0x40}},
+    [KEY_SEARCH]                            = {{2,0xE0,0x10},         {3,0xE0,0xF0,0x10}},
+    [KEY_HOMEPAGE]                          = {{2,0xE0,0x3A},         {3,0xE0,0xF0,0x3A}},
+    [KEY_BACK]                              = {{2,0xE0,0x38},         {3,0xE0,0xF0,0x38}},
+    [KEY_FORWARD]                           = {{2,0xE0,0x30},         {3,0xE0,0xF0,0x30}},
+    [KEY_WWW_STOP]                          = {{2,0xE0,0x28},         {3,0xE0,0xF0,0x28}},
+    [KEY_REFRESH]                           = {{2,0xE0,0x20},         {3,0xE0,0xF0,0x20}},
+    [KEY_BOOKMARKS]                         = {{2,0xE0,0x18},         {3,0xE0,0xF0,0x18}},
+    [KEY_SYSTEM_POWER]                      = {{2,0xE0,0x37},         {3,0xE0,0xF0,0x37}},
+    [KEY_SLEEP]                             = {{2,0xE0,0x3F},         {3,0xE0,0xF0,0x3F}},
+    [KEY_WAKEUP]                            = {{2,0xE0,0x5E},         {3,0xE0,0xF0,0x5E}},
+};
+
+static const struct
+{
+    uint8_t page;
+    uint16_t usage;
+    uint8_t key;
+} usageKeys[] =
+{
+    {HID_USAGE_PAGE_GENERIC_DESKTOP, 0x081, KEY_SYSTEM_POWER},
+    {HID_USAGE_PAGE_GENERIC_DESKTOP, 0x082, KEY_SLEEP},
+    {HID_USAGE_PAGE_GENERIC_DESKTOP, 0x083, KEY_WAKEUP},
+    {HID_USAGE_PAGE_CONSUMER,        0x0B5, KEY_NEXTSONG},
+    {HID_USAGE_PAGE_CONSUMER,        0x0B6, KEY_PREVIOUSSONG},
+    {HID_USAGE_PAGE_CONSUMER,        0x0B7, KEY_STOPCD},
+    {HID_USAGE_PAGE_CONSUMER,        0x0CD, KEY_PLAYPAUSE},
+    {HID_USAGE_PAGE_CONSUMER,        0x0E2, KEY_CONSUMER_MUTE},
+    {HID_USAGE_PAGE_CONSUMER,        0x0E9, KEY_CONSUMER_VOLUME_UP},
+    {HID_USAGE_PAGE_CONSUMER,        0x0EA, KEY_CONSUMER_VOLUME_DOWN},
+    {HID_USAGE_PAGE_CONSUMER,        0x183, KEY_MEDIA},
+    {HID_USAGE_PAGE_CONSUMER,        0x18A, KEY_MAIL},
+    {HID_USAGE_PAGE_CONSUMER,        0x192, KEY_CALC},
+    {HID_USAGE_PAGE_CONSUMER,        0x194, KEY_COMPUTER},
+    {HID_USAGE_PAGE_CONSUMER,        0x221, KEY_SEARCH},
+    {HID_USAGE_PAGE_CONSUMER,        0x223, KEY_HOMEPAGE},
+    {HID_USAGE_PAGE_CONSUMER,        0x224, KEY_BACK},
+    {HID_USAGE_PAGE_CONSUMER,        0x225, KEY_FORWARD},
+    {HID_USAGE_PAGE_CONSUMER,        0x226, KEY_WWW_STOP},
+    {HID_USAGE_PAGE_CONSUMER,        0x227, KEY_REFRESH},
+    {HID_USAGE_PAGE_CONSUMER,        0x22A, KEY_BOOKMARKS},
 };
 
+unsigned hidUsageToKey(const unsigned usagePage, const unsigned usage)
+{
+    for(unsigned n=0; n<sizeof usageKeys/sizeof*usageKeys; ++n)
+        if(usageKeys[n].page==usagePage && usageKeys[n].usage==usage)
+            return usageKeys[n].key;
+    return 0;
+}
+
+bool hidUsageRangeHasKeys(const unsigned usagePage, const unsigned usageMin, const unsigned usageMax)
+{
+    for(unsigned n=0; n<sizeof usageKeys/sizeof*usageKeys; ++n)
+        if(usageKeys[n].page==usagePage && usageKeys[n].usage>=usageMin && usageKeys[n].usage<=usageMax)
+            return true;
+    return false;
+}
+
 const uint8_t* keyToMakeCode(unsigned key, bool ctrl, bool shift, bool alt, bool numLockLED, bool autorepeat)
 {
     if(key >= sizeof scanCodes/sizeof*scanCodes) return NULL;
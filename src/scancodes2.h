@@ -5,6 +5,40 @@ extern "C"
 {
 #endif
 
+// Keys of Consumer and System Control usages. They are numbered in the range reserved on the keyboard usage page,
+// so that all the keys fit into 8 bits and are handled by the same code as the keyboard ones.
+#define KEY_NEXTSONG                0xE8
+#define KEY_PREVIOUSSONG            0xE9
+#define KEY_STOPCD                  0xEA
+#define KEY_PLAYPAUSE               0xEB
+#define KEY_CONSUMER_MUTE           0xEC
+#define KEY_CONSUMER_VOLUME_UP      0xED
+#define KEY_CONSUMER_VOLUME_DOWN    0xEE
+#define KEY_MEDIA                   0xEF
+#define KEY_MAIL                    0xF0
+#define KEY_CALC                    0xF1
+#define KEY_COMPUTER                0xF2
+#define KEY_SEARCH                  0xF3
+#define KEY_HOMEPAGE                0xF4
+#define KEY_BACK                    0xF5
+#define KEY_FORWARD                 0xF6
+#define KEY_WWW_STOP                0xF7
+#define KEY_REFRESH                 0xF8
+#define KEY_BOOKMARKS               0xF9
+#define KEY_SYSTEM_POWER            0xFD
+#define KEY_SLEEP                   0xFE
+#define KEY_WAKEUP                  0xFF
+
+#define KEY_CONSUMER_FIRST KEY_NEXTSONG
+#define KEY_CONSUMER_LAST  KEY_BOOKMARKS
+#define KEY_SYSTEM_FIRST   KEY_SYSTEM_POWER
+#define KEY_SYSTEM_LAST    KEY_WAKEUP
+
+// Returns the key for a usage on Consumer or Generic Desktop page, 0 if there's no scan code for it
+unsigned hidUsageToKey(unsigned usagePage, unsigned usage);
+// Whether hidUsageToKey() gives a key for any usage in the range
+bool hidUsageRangeHasKeys(unsigned usagePage, unsigned usageMin, unsigned usageMax);
+
 const uint8_t* keyToMakeCode(unsigned key, bool ctrl, bool shift, bool alt, bool numLockLED, bool autorepeat);
 const uint8_t* keyToBreakCode(unsigned key, bool ctrl, bool shift, bool alt, bool numLockLED);
 
@@ -0,0 +1,133 @@
+#include "stm32f4xx_hal.h"
+#include "usbh_conf.h"
+#include "SPSCQueue.hpp"
+#include "ps2-kbd-emulator.h"
+#include "pipeline-stats.h"
+#include "typematic.h"
+
+// Typematic repeat is timed by compare channel 1 of TIM5, a free-running 32-bit counter. Each repeat of a slot
+// is due exactly one period after the previous one, and the interrupt queues its key at that time, so the rate
+// doesn't depend on how busy the main loop is. The main loop makes the events from the queued keys, with the
+// modifiers and Num Lock state in effect at the time.
+
+// Below the PS/2 bus driver and USB interrupts: a repeat can wait for them a bit
+constexpr uint32_t TYPEMATIC_IRQ_PRIORITY=7;
+
+namespace
+{
+
+struct Slot
+{
+    uint8_t key;       // 0 if nothing repeats in the slot
+    uint32_t dueTicks; // TIM5 count at which the next repeat is due
+};
+
+// Changed by the main loop only with the timer interrupt masked
+Slot slots[TYPEMATIC_NUM_SLOTS];
+SPSCQueue<4> repeatQueue; // Filled by the timer interrupt, emptied by the main loop
+
+bool isDue(const uint32_t ticks, const uint32_t now)
+{
+    return int32_t(now-ticks) >= 0;
+}
+
+// Must be called from the timer interrupt or with it masked
+void scheduleNextRepeat()
+{
+    const Slot* next=nullptr;
+    for(const auto& slot : slots)
+    {
+        if(slot.key && (!next || int32_t(slot.dueTicks-next->dueTicks) < 0))
+            next=&slot;
+    }
+    TIM5->SR=~TIM_SR_CC1IF; // rc_w0 bits: writing 1 leaves them alone, unlike a read-modify-write
+    if(!next)
+    {
+        TIM5->DIER &= ~TIM_DIER_CC1IE;
+        return;
+    }
+    TIM5->CCR1=next->dueTicks;
+    TIM5->DIER |= TIM_DIER_CC1IE;
+    // A compare value the counter has already passed would only match after it wraps around
+    if(isDue(next->dueTicks, TIM5->CNT))
+        TIM5->EGR=TIM_EGR_CC1G;
+}
+
+void maskTimerInterrupt()
+{
+    NVIC_DisableIRQ(TIM5_IRQn);
+}
+
+void unmaskTimerInterrupt()
+{
+    NVIC_EnableIRQ(TIM5_IRQn);
+}
+
+}
+
+extern "C" void TIM5_IRQHandler()
+{
+    const uint32_t now=TIM5->CNT;
+    for(auto& slot : slots)
+    {
+        if(!slot.key || !isDue(slot.dueTicks, now))
+            continue;
+        if(!repeatQueue.push(slot.key))
+            ++pipelineStats.repeatsNotPickedUp;
+        slot.dueTicks+=autorepeatPeriodInTicks;
+        // If the interrupt has been delayed by more than a period, don't try to catch up: the host can't
+        // tell the number of repeats anyway
+        if(isDue(slot.dueTicks, now))
+            slot.dueTicks=now+autorepeatPeriodInTicks;
+    }
+    scheduleNextRepeat();
+}
+
+void Typematic_Init()
+{
+    __HAL_RCC_TIM5_CLK_ENABLE();
+    TIM5->CR1=0;
+    TIM5->PSC=SystemCoreClock/TYPEMATIC_TICK_RATE-1;
+    TIM5->ARR=UINT32_MAX;
+    TIM5->EGR=TIM_EGR_UG; // Load the prescaler
+    TIM5->SR=0;
+    TIM5->CR1=TIM_CR1_CEN;
+    HAL_NVIC_SetPriority(TIM5_IRQn, TYPEMATIC_IRQ_PRIORITY, 0);
+    HAL_NVIC_EnableIRQ(TIM5_IRQn);
+    USBH_UsrLog("Typematic timer started");
+}
+
+void Typematic_KeyPressed(const unsigned slot, const uint8_t key)
+{
+    maskTimerInterrupt();
+    slots[slot].key=key;
+    slots[slot].dueTicks=TIM5->CNT+autorepeatDelayInTicks;
+    scheduleNextRepeat();
+    unmaskTimerInterrupt();
+}
+
+void Typematic_KeyReleased(const unsigned slot, const uint8_t key)
+{
+    // Only the main loop changes the keys, so this one can be checked without masking the interrupt
+    if(slots[slot].key!=key)
+        return;
+    maskTimerInterrupt();
+    slots[slot].key=0;
+    scheduleNextRepeat();
+    unmaskTimerInterrupt();
+}
+
+void Typematic_StopAll()
+{
+    maskTimerInterrupt();
+    for(auto& slot : slots)
+        slot.key=0;
+    scheduleNextRepeat();
+    unmaskTimerInterrupt();
+    repeatQueue.clear();
+}
+
+bool Typematic_PopRepeat(uint8_t*const key)
+{
+    return repeatQueue.pop(*key);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Rate at which TIM5, which times typematic repeats, counts
+#define TYPEMATIC_TICK_RATE 10000
+
+// Keys repeat independently in each slot. Like on a PS/2 keyboard, only the last key pressed in a slot repeats,
+// and it stops when that key is released, even if other keys of the slot are still held.
+enum
+{
+    TYPEMATIC_SLOT_KEYBOARD, // Keyboard page keys, including modifiers
+    TYPEMATIC_SLOT_CONTROL,  // Consumer and System Control keys, e.g. volume
+    TYPEMATIC_NUM_SLOTS
+};
+
+void Typematic_Init(void);
+// Starts the typematic delay of the key, which replaces the key repeating in the slot
+void Typematic_KeyPressed(unsigned slot, uint8_t key);
+// Stops the repeat in the slot if it's of this key
+void Typematic_KeyReleased(unsigned slot, uint8_t key);
+void Typematic_StopAll(void);
+// Takes the next key whose repeat is due. Returns false if there's none.
+bool Typematic_PopRepeat(uint8_t* key);
+
+#ifdef __cplusplus
+}
+#endif
@@ -46,8 +46,10 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f4xx_hal.h"
 #include "usbh_core.h"
+#include "usbh_hid.h"
 
 HCD_HandleTypeDef hhcd;
+volatile uint32_t usbhFrameStartCycles[USBH_FRAME_HISTORY];
 
 #define HOST_POWERSW_CLK_ENABLE()          __HAL_RCC_GPIOC_CLK_ENABLE()
 #define HOST_POWERSW_PORT                  GPIOC
@@ -128,7 +130,10 @@ void HAL_HCD_MspDeInit(HCD_HandleTypeDef *hhcd)
   */
 void HAL_HCD_SOF_Callback(HCD_HandleTypeDef *hhcd)
 {
-  USBH_LL_IncTimer (hhcd->pData);
+  USBH_HandleTypeDef *phost = hhcd->pData;
+  /* Stamp the frame before the class SOF process runs for it, since it may start transfers */
+  usbhFrameStartCycles[(phost->Timer + 1U) % USBH_FRAME_HISTORY] = DWT->CYCCNT;
+  USBH_LL_IncTimer (phost);
 }
 
 /**
@@ -181,7 +186,11 @@ void HAL_HCD_PortDisabled_Callback(HCD_HandleTypeDef *hhcd)
   */
 void HAL_HCD_HC_NotifyURBChange_Callback(HCD_HandleTypeDef *hhcd, uint8_t chnum, HCD_URBStateTypeDef urb_state)
 {
-  /* To be used with OS to sync URB state with the global state machine */
+  /* Lets the HID class start the next IN transfer without waiting for the main loop */
+  if (urb_state == URB_DONE)
+  {
+    USBH_HID_NotifyURBDone(hhcd->pData, chnum);
+  }
 }
 
 /*******************************************************************************
@@ -55,14 +55,19 @@
   */ 
 
 #define USBH_MAX_NUM_ENDPOINTS                2
-#define USBH_MAX_NUM_INTERFACES               2
+#define USBH_MAX_NUM_INTERFACES               4
 #define USBH_MAX_NUM_CONFIGURATION            2
 #define USBH_KEEP_CFG_DESCRIPTOR              0
 #define USBH_MAX_NUM_SUPPORTED_CLASS          1
 #define USBH_MAX_SIZE_CONFIGURATION           0x200
-#define USBH_MAX_DATA_BUFFER                  0x200
+#define USBH_MAX_DATA_BUFFER                  0x400
 #define USBH_DEBUG_LEVEL                      5
 #define USBH_USE_OS                           0
+
+#ifdef ENABLE_LOW_LATENCY_POLLING
+/* Honor bInterval of the HID endpoints down to 1 frame */
+#define HID_MIN_POLL                          1U
+#endif
     
 /** @defgroup USBH_Exported_Macros
   * @{
@@ -125,6 +130,9 @@
 /** @defgroup USBH_CONF_Exported_Variables
   * @{
   */ 
+/* DWT cycle counter at the start of the recent frames, indexed by phost->Timer modulo USBH_FRAME_HISTORY */
+#define USBH_FRAME_HISTORY                    8U
+extern volatile uint32_t usbhFrameStartCycles[USBH_FRAME_HISTORY];
 /**
   * @}
   */ 
@@ -2,3 +2,13 @@
 
 #define CONCAT_(a,b,c) a##b##c
 #define CONCAT(a,b,c) CONCAT_(a,b,c)
+
+// Code and data of the timing-critical interrupt handlers, run and read from SRAM rather than flash, so that
+// their timing doesn't depend on flash wait states and ART accelerator hits. Whether this lowers their worst-case
+// latency hasn't been measured; ENABLE_ISR_PROFILING can be used for that. They are copied from flash to SRAM by
+// the startup code. Everything a RAMFUNC calls is inlined into it, so that no part of its call tree is left in
+// flash.
+#define RAMFUNC __attribute__((section(".ramfunc"),flatten))
+#define FASTDATA __attribute__((section(".fastdata")))
+// FASTDATA for constants: GCC doesn't allow read-only and writable data in one section
+#define FASTCONST __attribute__((section(".fastdata.const")))